@@ -0,0 +1,478 @@
+/*
+ * RSFS - Really Simple File System
+ *
+ * Copyright © 2026 LabSO-ProjetoFinal contributors
+ *
+ * This file is part of RSFS.
+ *
+ * RSFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Gerador de carga do sistema de arquivos. Cada cenário formata a imagem
+ * (menos seqread, que lê o arquivo deixado por seqwrite), mede cada operação
+ * e imprime uma linha com campos chave=valor:
+ *
+ *   creates   muitos arquivos pequenos criados, escritos e fechados
+ *   seqwrite  um arquivo grande escrito sequencialmente em blocos
+ *   seqread   o mesmo arquivo lido sequencialmente em blocos
+ *   frag      criações e remoções intercaladas, que fragmentam o espaço
+ *   copy      cópia de um arquivo grande para outro, dentro da imagem
+ *   pcopy     o mesmo volume de copy dividido entre várias threads, cada uma
+ *             copiando o seu arquivo (-t), para medir o ganho com o paralelismo
+ *
+ * As contagens de setores são as transferências com a imagem (disk.c). Só essas
+ * linhas vão para a saída padrão; as mensagens do sistema de arquivos e os
+ * erros vão para stderr. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "disk.h"
+#include "fs.h"
+
+#define CACHE_SECTORS 256
+#define BIG_FILE "seq"
+#define FRAG_MAX (15 * 4096)  /* Maior arquivo de frag */
+
+/* Parâmetros dos cenários (opções da linha de comando) */
+int nfiles = 1000;           /* Arquivos de creates e de frag */
+int small_size = 4096;       /* Tamanho dos arquivos de creates */
+long long big_size = 64LL * 1024 * 1024;
+int chunk = 1024 * 1024;     /* Bloco das transferências sequenciais */
+int format_bits = 0;         /* Geometria da formatação (0 = a padrão) */
+int format_kib = 0;
+int nthreads = 4;            /* Threads de pcopy */
+
+/* Medidas do cenário em andamento */
+double *lat = NULL;          /* Latência de cada operação, em segundos */
+int nlat = 0, lat_cap = 0;
+long long bytes = 0;
+pthread_mutex_t lat_lock = PTHREAD_MUTEX_INITIALIZER;  /* lat e bytes, em pcopy */
+double started;
+bl_cache_stats io_start;
+char *data;                  /* Conteúdo escrito pelos cenários */
+int data_size;
+FILE *out;                   /* Saída das linhas chave=valor */
+
+double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void record(double t0) {
+  if (nlat == lat_cap) {
+    lat_cap = lat_cap ? 2 * lat_cap : 1024;
+    lat = realloc(lat, lat_cap * sizeof(double));
+    if (lat == NULL) {
+      printf("Memória insuficiente\n");
+      exit(1);
+    }
+  }
+  lat[nlat++] = now() - t0;
+}
+
+int cmp_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+double percentile(double p) {
+  int i = (int) (p * (nlat - 1) + 0.5);
+  return nlat > 0 ? lat[i] : 0;
+}
+
+int format() {
+  if (format_bits == 0) {
+    return fs_format();
+  }
+  return fs_format_geometry(format_bits, format_kib * 1024);
+}
+
+void begin() {
+  nlat = 0;
+  bytes = 0;
+  bl_get_stats(&io_start);
+  started = now();
+}
+
+/* A escrita só termina quando os metadados e a cache estão no disco. */
+void end(char *scenario) {
+  bl_cache_stats io;
+  double secs;
+
+  fs_sync();
+  secs = now() - started;
+  bl_get_stats(&io);
+  qsort(lat, nlat, sizeof(double), cmp_double);
+
+  fprintf(out, "scenario=%s ops=%d bytes=%lld secs=%.6f ops_s=%.1f mb_s=%.2f p50_us=%.1f p99_us=%.1f "
+         "sectors_read=%ld sectors_written=%ld cache_hits=%ld cache_misses=%ld\n",
+         scenario, nlat, bytes, secs, nlat / secs, bytes / secs / (1024 * 1024),
+         percentile(0.50) * 1e6, percentile(0.99) * 1e6,
+         io.reads - io_start.reads, io.writes - io_start.writes,
+         io.hits - io_start.hits, io.misses - io_start.misses);
+  fflush(out);
+}
+
+/* Cria name com size bytes, escritos em blocos de chunk. Com timed, cada
+ * bloco é uma operação medida. */
+int write_file(char *name, long long size, int timed) {
+  int fd;
+  long long done;
+
+  if ((fd = fs_open(name, FS_W)) == -1) {
+    return 0;
+  }
+  for (done = 0; done < size; ) {
+    int n = size - done < chunk ? size - done : chunk;
+    double t0 = now();
+    if (fs_write(data, n, fd) != n) {
+      fs_close(fd);
+      return 0;
+    }
+    if (timed) {
+      record(t0);
+      bytes += n;
+    }
+    done += n;
+  }
+  return fs_close(fd);
+}
+
+int creates() {
+  char name[32];
+  int i, fd;
+
+  if (!format()) {
+    return 0;
+  }
+  begin();
+  for (i = 0; i < nfiles; i++) {
+    double t0 = now();
+    sprintf(name, "c%d", i);
+    if ((fd = fs_open(name, FS_W)) == -1 || fs_write(data, small_size, fd) != small_size || !fs_close(fd)) {
+      return 0;
+    }
+    record(t0);
+    bytes += small_size;
+  }
+  end("creates");
+  return 1;
+}
+
+int seqwrite() {
+  if (!format()) {
+    return 0;
+  }
+  begin();
+  if (!write_file(BIG_FILE, big_size, 1)) {
+    return 0;
+  }
+  end("seqwrite");
+  return 1;
+}
+
+int seqread() {
+  int fd, n;
+  double t0;
+
+  /* Sem seqwrite antes, o arquivo é criado fora da medida */
+  if ((fd = fs_open(BIG_FILE, FS_R)) == -1) {
+    if (!format() || !write_file(BIG_FILE, big_size, 0) || (fd = fs_open(BIG_FILE, FS_R)) == -1) {
+      return 0;
+    }
+  }
+  begin();
+  for (t0 = now(); (n = fs_read(data, chunk, fd)) > 0; t0 = now()) {
+    record(t0);
+    bytes += n;
+  }
+  fs_close(fd);
+  end("seqread");
+  return n == 0;
+}
+
+/* Arquivos de 1 a 8 clusters, dos quais metade é removida e substituída por
+ * arquivos maiores, que só cabem nos buracos em pedaços. */
+int frag() {
+  char name[32];
+  int i, fd;
+
+  if (!format()) {
+    return 0;
+  }
+  srand(1);
+  begin();
+  for (i = 0; i < nfiles; i++) {
+    double t0 = now();
+    int size = (1 + rand() % 8) * 4096;
+    sprintf(name, "f%d", i);
+    if ((fd = fs_open(name, FS_W)) == -1 || fs_write(data, size, fd) != size || !fs_close(fd)) {
+      return 0;
+    }
+    record(t0);
+    bytes += size;
+  }
+  for (i = 0; i < nfiles; i += 2) {
+    double t0 = now();
+    sprintf(name, "f%d", i);
+    if (!fs_remove(name)) {
+      return 0;
+    }
+    record(t0);
+  }
+  for (i = 0; i < nfiles / 4; i++) {
+    double t0 = now();
+    int size = (8 + rand() % 8) * 4096;
+    sprintf(name, "g%d", i);
+    if ((fd = fs_open(name, FS_W)) == -1 || fs_write(data, size, fd) != size || !fs_close(fd)) {
+      return 0;
+    }
+    record(t0);
+    bytes += size;
+  }
+  end("frag");
+  return 1;
+}
+
+/* Cópia em blocos de chunk: bytes conta o que foi lido e escrito. */
+int copy() {
+  int fd1, fd2, n;
+
+  if (!format() || !write_file(BIG_FILE, big_size, 0)) {
+    return 0;
+  }
+  begin();
+  if ((fd1 = fs_open(BIG_FILE, FS_R)) == -1 || (fd2 = fs_open("copia", FS_W)) == -1) {
+    return 0;
+  }
+  for (;;) {
+    double t0 = now();
+    if ((n = fs_read(data, chunk, fd1)) <= 0) {
+      break;
+    }
+    if (fs_write(data, n, fd2) != n) {
+      return 0;
+    }
+    record(t0);
+    bytes += 2 * n;
+  }
+  fs_close(fd1);
+  fs_close(fd2);
+  end("copy");
+  return n == 0;
+}
+
+/* Uma thread de pcopy: copia o arquivo pN para qN, com o seu próprio bloco. */
+void *pcopy_thread(void *arg) {
+  char name[32], copy_name[32], *buffer;
+  long t = (long) arg;
+  int fd1, fd2, n = -1;
+
+  sprintf(name, "p%ld", t);
+  sprintf(copy_name, "q%ld", t);
+  if ((buffer = malloc(chunk)) == NULL) {
+    printf("Memória insuficiente\n");
+    return NULL;
+  }
+  fd1 = fs_open(name, FS_R);
+  fd2 = fd1 == -1 ? -1 : fs_open(copy_name, FS_W);
+  for (; fd2 != -1; ) {
+    double t0 = now();
+    if ((n = fs_read(buffer, chunk, fd1)) <= 0) {
+      break;
+    }
+    if (fs_write(buffer, n, fd2) != n) {
+      n = -1;
+      break;
+    }
+    pthread_mutex_lock(&lat_lock);
+    record(t0);
+    bytes += 2 * n;
+    pthread_mutex_unlock(&lat_lock);
+  }
+  if (fd1 != -1) {
+    fs_close(fd1);
+  }
+  if (fd2 != -1) {
+    fs_close(fd2);
+  }
+  free(buffer);
+  return n == 0 ? arg : NULL;
+}
+
+/* Como copy, mas o arquivo grande é dividido em nthreads arquivos copiados ao
+ * mesmo tempo, cada um por uma thread. */
+int pcopy() {
+  pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+  char name[32];
+  long t;
+  int ok = threads != NULL && format();
+
+  for (t = 0; ok && t < nthreads; t++) {
+    sprintf(name, "p%ld", t);
+    ok = write_file(name, big_size / nthreads, 0);
+  }
+  if (!ok) {
+    free(threads);
+    return 0;
+  }
+
+  begin();
+  for (t = 0; t < nthreads; t++) {
+    if (pthread_create(&threads[t], NULL, pcopy_thread, (void *) t) != 0) {
+      perror("Criando thread");
+      exit(1);
+    }
+  }
+  for (t = 0; t < nthreads; t++) {
+    void *result;
+    pthread_join(threads[t], &result);
+    ok = ok && result == (void *) t;
+  }
+  free(threads);
+  if (!ok) {
+    return 0;
+  }
+  end("pcopy");
+  return 1;
+}
+
+struct {
+  char *name;
+  int (*run)();
+} scenarios[] = {
+  {"creates", creates},
+  {"seqwrite", seqwrite},
+  {"seqread", seqread},
+  {"frag", frag},
+  {"copy", copy},
+  {"pcopy", pcopy},
+};
+
+#define NSCENARIOS (int) (sizeof(scenarios) / sizeof(scenarios[0]))
+
+void usage(char *prog) {
+  printf("Uso: %s [-c setores] [-w] [-m] [-g bits,KiB] [-n arquivos] [-s bytes] [-l MB] [-k KiB] [-t threads] imagem tamanho [cenário...]\n", prog);
+  printf("Onde: imagem é o arquivo contendo a imagem do disco (será formatada).\n");
+  printf("      tamanho é o tamanho da imagem em MB.\n");
+  printf("      cenário é creates, seqwrite, seqread, frag, copy ou pcopy (padrão: todos).\n");
+  printf("      -c, -w e -m configuram a cache e o mapeamento como no rsfs.\n");
+  printf("      -g formata com FAT de bits bits e clusters de KiB KiB.\n");
+  printf("      -n arquivos de creates e frag (padrão %d); -s tamanho deles em creates (padrão %d).\n", nfiles, small_size);
+  printf("      -l tamanho do arquivo grande em MB (padrão %lld); -k bloco das leituras e escritas em KiB (padrão %d).\n",
+         big_size / (1024 * 1024), chunk / 1024);
+  printf("      -t threads de pcopy (padrão %d).\n", nthreads);
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  int opt, i, j, size, ok;
+  int cache_sectors = CACHE_SECTORS, cache_policy = BL_WRITE_THROUGH, flags = 0;
+
+  while ((opt = getopt(argc, argv, "c:wmg:n:s:l:k:t:")) != -1) {
+    switch (opt) {
+    case 'c':
+      cache_sectors = atoi(optarg);
+      break;
+    case 'w':
+      cache_policy = BL_WRITE_BACK;
+      break;
+    case 'm':
+      flags |= BL_MMAP;
+      break;
+    case 'g':
+      if (sscanf(optarg, "%d,%d", &format_bits, &format_kib) != 2) {
+        usage(argv[0]);
+      }
+      break;
+    case 'n':
+      nfiles = atoi(optarg);
+      break;
+    case 's':
+      small_size = atoi(optarg);
+      break;
+    case 'l':
+      big_size = atoll(optarg) * 1024 * 1024;
+      break;
+    case 'k':
+      chunk = atoi(optarg) * 1024;
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind < 2 || nfiles < 1 || small_size < 1 || big_size < 1 || chunk < 1 || nthreads < 1) {
+    usage(argv[0]);
+  }
+
+  size = (atoll(argv[optind + 1]) * 1024 * 1024) / SECTORSIZE;
+
+  /* O buffer serve a todas as escritas: um bloco, um arquivo de creates ou de frag */
+  data_size = chunk > small_size ? chunk : small_size;
+  if (data_size < FRAG_MAX) {
+    data_size = FRAG_MAX;
+  }
+  data = malloc(data_size);
+  if (data == NULL) {
+    printf("Memória insuficiente\n");
+    exit(1);
+  }
+  for (i = 0; i < data_size; i++) {
+    data[i] = rand();
+  }
+
+  /* disk.c e fs.c escrevem suas mensagens em stdout, que passa a ser stderr;
+   * os resultados seguem pela saída padrão original */
+  fflush(stdout);
+  if ((out = fdopen(dup(1), "w")) == NULL || dup2(2, 1) == -1) {
+    perror("Redirecionando a saída");
+    exit(1);
+  }
+
+  if (!bl_init(argv[optind], size, flags) || !bl_cache_init(cache_sectors, cache_policy) || !fs_init()) {
+    exit(1);
+  }
+
+  ok = 1;
+  for (i = optind + 2; ok && i <= argc; i++) {
+    for (j = 0; j < NSCENARIOS; j++) {
+      if (i == argc ? optind + 2 == argc : !strcmp(argv[i], scenarios[j].name)) {
+        if (!(ok = scenarios[j].run())) {
+          printf("Erro: cenário %s falhou\n", scenarios[j].name);
+          break;
+        }
+        if (i < argc) {
+          break;
+        }
+      }
+    }
+    if (i < argc && j == NSCENARIOS) {
+      printf("Cenário inválido: %s\n", argv[i]);
+      ok = 0;
+    }
+  }
+
+  fs_shutdown();
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,322 @@
+/*
+ * RSFS - Really Simple File System
+ *
+ * Copyright © 2026 LabSO-ProjetoFinal contributors
+ *
+ * This file is part of RSFS.
+ *
+ * RSFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Verificações do comportamento da API (make check). Cada verificação usa
+ * uma imagem recém-formatada e imprime a sua falha; o programa termina com
+ * status 1 se alguma falhar. As verificações de remontagem gravam a imagem
+ * num processo e a conferem em outro, depois de fs_shutdown ou de uma queda
+ * simulada (o processo termina sem desmontar). */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "disk.h"
+#include "fs.h"
+
+#define IMAGE "check.img"
+#define IMAGE_SECTORS 2560
+#define PATTERN_SIZE (300 * 1024)
+
+int failures = 0;
+long long empty_free;  /* Bytes livres na imagem recém-formatada */
+char expected[PATTERN_SIZE + 1024], got[PATTERN_SIZE + 1024];
+
+void fail(const char *check, char *what) {
+  fprintf(stderr, "%s: %s\n", check, what);
+  failures++;
+}
+
+/* Cria name com o conteúdo data. */
+int put(char *name, char *data, int size) {
+  int fd = fs_open(name, FS_W), ok;
+
+  if (fd == -1) {
+    return 0;
+  }
+  ok = fs_write(data, size, fd) == size;
+  return fs_close(fd) && ok;
+}
+
+/* Confere se name tem exatamente o conteúdo data. */
+int same(char *name, char *data, int size) {
+  char buffer[256];
+  int fd, n;
+
+  if ((fd = fs_open(name, FS_R)) == -1) {
+    return 0;
+  }
+  n = fs_read(buffer, sizeof(buffer), fd);
+  fs_close(fd);
+  return n == size && memcmp(buffer, data, size) == 0;
+}
+
+/* Preenche buffer com o conteúdo de teste seed, diferente em cada cluster. */
+void fill(char *buffer, int size, int seed) {
+  int i;
+
+  for (i = 0; i < size; i++) {
+    buffer[i] = (char) (i * 31 + i / 4096 * 7 + seed);
+  }
+}
+
+/* Cria name (aberto com mode) com size bytes do conteúdo seed. */
+int put_pattern(char *name, int mode, int size, int seed) {
+  int fd = fs_open(name, mode), ok;
+
+  if (fd == -1) {
+    return 0;
+  }
+  fill(expected, size, seed);
+  ok = fs_write(expected, size, fd) == size;
+  return fs_close(fd) && ok;
+}
+
+/* Confere se name tem exatamente os size bytes de data. */
+int same_large(char *name, char *data, int size) {
+  int fd, n;
+
+  if ((fd = fs_open(name, FS_R)) == -1) {
+    return 0;
+  }
+  n = fs_pread(got, sizeof(got), fd, 0);
+  fs_close(fd);
+  return n == size && memcmp(got, data, size) == 0;
+}
+
+/* Remove os arquivos e desmonta a imagem. */
+int remove_all(const char *check, char **names, int count) {
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (!fs_remove(names[i])) {
+      fail(check, "remoção falhou");
+      return 0;
+    }
+  }
+  return fs_shutdown();
+}
+
+/* Sem arquivos, todo o espaço da imagem recém-formatada volta a estar livre (o
+ * índice de conteúdo de arquivos já removidos só é liberado ao desmontar). */
+int empty_verify(int clean) {
+  if (fs_free() != empty_free) {
+    fail(__func__, "espaço livre diferente do da imagem vazia depois das remoções");
+    return 0;
+  }
+  return 1;
+}
+
+/* Ler até o fim em FS_RW e depois escrever acrescenta ao arquivo. */
+void read_to_end_then_write() {
+  char buffer[16];
+  int fd;
+
+  if (!put("a", "hello", 5) || (fd = fs_open("a", FS_RW)) == -1) {
+    fail(__func__, "não foi possível preparar o arquivo");
+    return;
+  }
+  while (fs_read(buffer, 2, fd) > 0);
+  if (fs_read(buffer, sizeof(buffer), fd) != 0) {
+    fail(__func__, "leitura no fim não devolveu 0");
+  }
+  if (fs_write(" world", 6, fd) != 6 || !fs_close(fd)) {
+    fail(__func__, "escrita falhou");
+  } else if (!same("a", "hello world", 11)) {
+    fail(__func__, "conteúdo diferente de \"hello world\"");
+  }
+}
+
+/* Uma leitura além do fim não move o cursor: a escrita seguinte fica na
+ * posição pedida por fs_seek. */
+void seek_past_end_then_write() {
+  char buffer[16];
+  int fd;
+
+  if (!put("b", "hello", 5) || (fd = fs_open("b", FS_RW)) == -1) {
+    fail(__func__, "não foi possível preparar o arquivo");
+    return;
+  }
+  if (!fs_seek(fd, 8) || fs_read(buffer, sizeof(buffer), fd) != 0) {
+    fail(__func__, "leitura além do fim não devolveu 0");
+  }
+  if (fs_write("x", 1, fd) != 1 || !fs_close(fd)) {
+    fail(__func__, "escrita falhou");
+  } else if (!same("b", "hello\0\0\0x", 9)) {
+    fail(__func__, "conteúdo diferente de \"hello\\0\\0\\0x\"");
+  }
+}
+
+/* Uma leitura de 0 bytes no meio do arquivo não move o cursor. */
+void empty_read_keeps_position() {
+  char buffer[16];
+  int fd;
+
+  if (!put("c", "hello", 5) || (fd = fs_open("c", FS_RW)) == -1) {
+    fail(__func__, "não foi possível preparar o arquivo");
+    return;
+  }
+  if (fs_read(buffer, 2, fd) != 2 || fs_read(buffer, 0, fd) != 0) {
+    fail(__func__, "leitura falhou");
+  }
+  if (fs_write("LLO", 3, fd) != 3 || !fs_close(fd)) {
+    fail(__func__, "escrita falhou");
+  } else if (!same("c", "heLLO", 5)) {
+    fail(__func__, "conteúdo diferente de \"heLLO\"");
+  }
+}
+
+/* Journal: criar, sobrescrever, alterar e remover arquivos maiores que um
+ * grupo do journal. */
+int journal_write(int clean) {
+  int fd, ok;
+
+  if (!fs_format() || !put_pattern("j1", FS_W, PATTERN_SIZE, 1) ||
+      !put_pattern("j2", FS_W, PATTERN_SIZE, 2) || !put("j3", "hello", 5) ||
+      !fs_remove("j2") || !put_pattern("j1", FS_W, PATTERN_SIZE / 2, 3) ||
+      (fd = fs_open("j3", FS_RW)) == -1) {
+    return 0;
+  }
+  ok = fs_pwrite("LLO", 3, fd, 2) == 3;
+  return fs_close(fd) && ok && (clean ? fs_shutdown() : fs_sync());
+}
+
+int journal_verify(int clean) {
+  char *names[] = {"j1", "j3"};
+
+  fill(expected, PATTERN_SIZE / 2, 3);
+  if (!same_large("j1", expected, PATTERN_SIZE / 2) || !same("j3", "heLLO", 5)) {
+    fail(__func__, "conteúdo diferente do gravado");
+    return 0;
+  }
+  if (fs_reclaimable("j2") != 0) {
+    fail(__func__, "arquivo removido voltou");
+    return 0;
+  }
+  return remove_all(__func__, names, 2);
+}
+
+/* Cópias: uma alterada no meio e no fim (passa a ter mapa de clusters) e outra
+ * que continua compartilhando tudo depois que a origem é removida. */
+int clone_write(int clean) {
+  int fd, ok;
+
+  if (!fs_format() || !put_pattern("c1", FS_W, PATTERN_SIZE, 4) || !fs_clone("c1", "c2") ||
+      !fs_clone("c1", "c3") || !fs_remove("c1") || (fd = fs_open("c2", FS_RW)) == -1) {
+    return 0;
+  }
+  memset(got, 'x', 1000);
+  ok = fs_pwrite(got, 100, fd, 5000) == 100 && fs_pwrite(got, 1000, fd, PATTERN_SIZE) == 1000;
+  return fs_close(fd) && ok && (clean ? fs_shutdown() : fs_sync());
+}
+
+int clone_verify(int clean) {
+  char *names[] = {"c2", "c3"};
+
+  fill(expected, PATTERN_SIZE, 4);
+  if (!same_large("c3", expected, PATTERN_SIZE)) {
+    fail(__func__, "cópia não alterada diferente da origem");
+    return 0;
+  }
+  memset(&expected[5000], 'x', 100);
+  memset(&expected[PATTERN_SIZE], 'x', 1000);
+  if (!same_large("c2", expected, PATTERN_SIZE + 1000)) {
+    fail(__func__, "cópia alterada diferente do gravado");
+    return 0;
+  }
+  return remove_all(__func__, names, 2);
+}
+
+/* Deduplicação: dois arquivos iguais e um diferente, removido. */
+int dedup_write(int clean) {
+  if (!fs_format() || !put_pattern("d1", FS_W | FS_D, PATTERN_SIZE, 5) ||
+      !put_pattern("d2", FS_W | FS_D, PATTERN_SIZE, 5) ||
+      !put_pattern("d3", FS_W | FS_D, PATTERN_SIZE, 6) || !fs_remove("d3")) {
+    return 0;
+  }
+  return clean ? fs_shutdown() : fs_sync();
+}
+
+int dedup_verify(int clean) {
+  char *names[] = {"d1", "d2"};
+
+  fill(expected, PATTERN_SIZE, 5);
+  if (!same_large("d1", expected, PATTERN_SIZE) || !same_large("d2", expected, PATTERN_SIZE)) {
+    fail(__func__, "conteúdo diferente do gravado");
+    return 0;
+  }
+  return remove_all(__func__, names, 2);
+}
+
+/* Monta a imagem num processo filho e roda step nele. */
+int in_child(int (*step)(int), int clean) {
+  pid_t pid;
+  int status, ok;
+
+  fflush(stdout);
+  if ((pid = fork()) == 0) {
+    ok = bl_init(IMAGE, IMAGE_SECTORS, 0) && fs_init() && step(clean);
+    fflush(stdout);
+    _exit(!ok);
+  }
+  return pid != -1 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Grava a imagem com write e, depois de desmontá-la (clean) ou de uma queda
+ * logo após fs_sync, confere com verify o que ficou nela. verify remove os
+ * arquivos, e a imagem deve voltar ao espaço livre de quando foi formatada. */
+void remount_check(const char *check, int (*write)(int), int (*verify)(int), int clean) {
+  if (!in_child(write, clean)) {
+    fail(check, "não foi possível gravar a imagem");
+  } else if (!in_child(verify, clean)) {
+    fail(check, clean ? "imagem errada depois de remontar" : "imagem errada depois da queda");
+  } else if (!in_child(empty_verify, clean)) {
+    fail(check, "espaço dos arquivos removidos não voltou");
+  }
+}
+
+int main() {
+  int clean;
+
+  unlink(IMAGE);
+  if (!bl_init(IMAGE, IMAGE_SECTORS, 0) || !fs_init() || !fs_format()) {
+    fprintf(stderr, "Não foi possível preparar a imagem %s\n", IMAGE);
+    return 1;
+  }
+  empty_free = fs_free();
+
+  read_to_end_then_write();
+  seek_past_end_then_write();
+  empty_read_keeps_position();
+
+  fs_shutdown();
+  for (clean = 0; clean < 2; clean++) {
+    remount_check("journal", journal_write, journal_verify, clean);
+    remount_check("clone", clone_write, clone_verify, clean);
+    remount_check("dedup", dedup_write, dedup_verify, clean);
+  }
+  unlink(IMAGE);
+  if (failures == 0) {
+    printf("check: ok\n");
+  }
+  return failures > 0;
+}
@@ -20,75 +20,705 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "disk.h"
+#include "stats.h"
 
-int device_size;
-FILE *stream;
+#define MAXIOV 1024  /* Limite de vetores por chamada preadv/pwritev */
 
-int bl_init(char *file, int size) {
+off_t device_size;
+int device_fd = -1;
+char *device_map = NULL;  /* Imagem mapeada em memória (modo BL_MMAP) */
+
+/*
+ * Cache de setores com substituição LRU, dividida em CACHE_SHARDS partes
+ * independentes: cada setor pertence a uma delas (pelo hash do número do
+ * setor), e cada parte tem suas entradas, sua lista LRU (mais recente na
+ * cabeça), sua tabela hash e sua trava. Threads que usam setores de partes
+ * diferentes não disputam trava nenhuma; o LRU vale dentro de cada parte.
+ *
+ * As transferências com a imagem são feitas sem as travas das partes, para
+ * que leituras e escritas de várias threads andem em paralelo. Os setores
+ * lidos numa falta só entram na cache se nenhuma escrita tiver passado pela
+ * parte enquanto isso (write_gen), pois poderiam estar desatualizados. Um
+ * setor escrito entra na cache depois de gravado na imagem; escritas do mesmo
+ * setor por duas threads ao mesmo tempo não têm ordem definida, e quem usa a
+ * cache (fs.c) nunca as faz. Sem cache, ou com a imagem mapeada, as
+ * transferências não usam trava.
+ */
+typedef struct {
+  int sector;
+  char dirty;
+  int prev, next;   /* lista LRU */
+  int hnext;        /* encadeamento da tabela hash */
+} cache_entry;
+
+#define CACHE_SHARD_BITS 4
+#define CACHE_SHARDS (1 << CACHE_SHARD_BITS)
+
+typedef struct {
+  cache_entry *entries;
+  char *data;
+  int *hash;
+  int size;
+  int buckets;
+  int used;
+  int lru_head, lru_tail;
+  unsigned long write_gen;  /* Escritas que passaram pela parte */
+  pthread_mutex_t lock;
+} cache_shard;
+
+static cache_shard shards[CACHE_SHARDS] = {[0 ... CACHE_SHARDS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+static int cache_size = 0;  /* Setores da cache, somando as partes */
+static int cache_policy = BL_WRITE_THROUGH;
+static bl_cache_stats stats;
+
+/* Os contadores são alterados por várias threads, fora das travas da cache */
+#define COUNT(field, n) __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+
+int bl_init(char *file, int size, int flags) {
   struct stat sb;
 
-  stream = NULL;
+  stats_init();
+  device_fd = -1;
+  device_map = NULL;
   if (stat(file, &sb) == 0) {
     if (S_ISREG(sb.st_mode)) {
       device_size = sb.st_size;
-      stream = fopen(file, "r+");
+      device_fd = open(file, O_RDWR);
     }
-    if (stream == NULL) {
+    if (device_fd == -1) {
       perror("Abrindo imagem pré-existente");
       return 0;
     }
   } else {
-    device_size = size * SECTORSIZE;
+    device_size = (off_t) size * SECTORSIZE;
     if (device_size < 1) {
       printf("Imagem não pode ter tamanho zero\n");
       return 0;
     }
-    stream = fopen(file, "w+");
-    if (stream == NULL) {
+    device_fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (device_fd == -1) {
       perror("Criando nova imagem");
       return 0;
     }
-    if (truncate(file, device_size) == -1) {
+    if (ftruncate(device_fd, device_size) == -1) {
       perror("Ajustando tamanho da imagem");
       return 0;
     }
   }
+
+  if (flags & BL_MMAP) {
+    device_map = mmap(NULL, device_size, PROT_READ | PROT_WRITE, MAP_SHARED, device_fd, 0);
+    if (device_map == MAP_FAILED) {
+      perror("Mapeando imagem em memória");
+      device_map = NULL;
+      return 0;
+    }
+  }
   return 1; 
 }
 
-int bl_size() {
-  return device_size / SECTORSIZE;
+/* Mapeia count setores a partir de sector em modo privado: as páginas são
+ * lidas da imagem apenas quando acessadas e as alterações feitas através do
+ * ponteiro ficam só na memória (para gravá-las, use bl_write). Funciona com
+ * ou sem BL_MMAP. Devolve NULL se não for possível. */
+char *bl_map_private(int sector, int count) {
+  char *p;
+
+  if (device_fd == -1 || sector < 0 || count < 1 || sector + count > bl_size()) {
+    return NULL;
+  }
+  p = mmap(NULL, (size_t) count * SECTORSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+           device_fd, (off_t) sector * SECTORSIZE);
+  return p == MAP_FAILED ? NULL : p;
 }
 
-int bl_write(int sector, char *buffer) {
-  if (fseek(stream, sector * SECTORSIZE, SEEK_SET) == -1) {
-    perror("Erro posicionando setor para escrita");
+/* Desfaz um mapeamento de count setores feito por bl_map_private. */
+void bl_unmap(char *p, int count) {
+  if (p != NULL) {
+    munmap(p, (size_t) count * SECTORSIZE);
+  }
+}
+
+/* Devolve um ponteiro direto para o setor dentro da imagem mapeada, ou NULL
+ * se a imagem não estiver mapeada. Alterações feitas através do ponteiro
+ * chegam ao disco em bl_sync. */
+char *bl_map(int sector) {
+  if (device_map == NULL || sector < 0 || sector >= bl_size()) {
+    return NULL;
+  }
+  return &device_map[(size_t) sector * SECTORSIZE];
+}
+
+/* Copia n bytes da imagem mapeada para buffer, a partir do byte offset do setor
+ * sector. É a leitura sem setores intermediários usada com BL_MMAP: os setores
+ * tocados contam como lidos da imagem. */
+int bl_map_read(int sector, int offset, char *buffer, int n) {
+  int first = sector + offset / SECTORSIZE;
+  int last = sector + (offset + n - 1) / SECTORSIZE;
+
+  STATS_OP(ST_BL_MAP_READ);
+  STATS_BYTES(n);
+  if (n < 1 || offset < 0 || bl_map(first) == NULL || bl_map(last) == NULL) {
+    printf("Erro: leitura fora da imagem mapeada\n");
     return 0;
   }
-  if (fwrite(buffer, sizeof(char), SECTORSIZE, stream) != SECTORSIZE) {
-    perror("Erro escrevendo setor");
+  COUNT(reads, last - first + 1);
+  memcpy(buffer, bl_map(first) + offset % SECTORSIZE, n);
+  return 1;
+}
+
+/* Cópia entre a imagem mapeada e um buffer. Quando o buffer já é o próprio
+ * setor (obtido com bl_map), não há nada a copiar. */
+static int map_xfer(int write, int sector, char *buffer) {
+  char *p = bl_map(sector);
+
+  if (p == NULL) {
+    printf("Erro: setor %d fora da imagem\n", sector);
+    return 0;
+  }
+  if (write) {
+    COUNT(writes, 1);
+  } else {
+    COUNT(reads, 1);
+  }
+  if (p != buffer) {
+    if (write) {
+      memcpy(p, buffer, SECTORSIZE);
+    } else {
+      memcpy(buffer, p, SECTORSIZE);
+    }
+  }
+  return 1;
+}
+
+int bl_size() {
+  return (int) (device_size / SECTORSIZE);
+}
+
+static int dev_write(int sector, char *buffer) {
+  off_t offset = (off_t) sector * SECTORSIZE;
+  ssize_t done = 0, n;
+
+  while (done < SECTORSIZE) {
+    n = pwrite(device_fd, buffer + done, SECTORSIZE - done, offset + done);
+    if (n <= 0) {
+      perror("Erro escrevendo setor");
+      return 0;
+    }
+    done += n;
+  }
+  COUNT(writes, 1);
+  return 1;
+}
+
+static int dev_read(int sector, char *buffer) {
+  off_t offset = (off_t) sector * SECTORSIZE;
+  ssize_t done = 0, n;
+
+  while (done < SECTORSIZE) {
+    n = pread(device_fd, buffer + done, SECTORSIZE - done, offset + done);
+    if (n <= 0) {
+      if (n == 0) {
+        printf("Erro lendo setor: fim da imagem\n");
+      } else {
+        perror("Erro lendo setor");
+      }
+      return 0;
+    }
+    done += n;
+  }
+  COUNT(reads, 1);
+  return 1;
+}
+
+/* Transfere count setores consecutivos a partir de sector com uma única
+ * chamada preadv/pwritev por lote de MAXIOV setores. Se a transferência
+ * vier incompleta, os setores restantes são refeitos um a um. */
+static int dev_xfer(int write, int sector, const struct iovec *iov, int count) {
+  int batch, i;
+  ssize_t n;
+
+  while (count > 0) {
+    batch = count < MAXIOV ? count : MAXIOV;
+    if (write) {
+      n = pwritev(device_fd, iov, batch, (off_t) sector * SECTORSIZE);
+    } else {
+      n = preadv(device_fd, iov, batch, (off_t) sector * SECTORSIZE);
+    }
+    i = n < 0 ? 0 : n / SECTORSIZE;
+    if (write) {
+      COUNT(writes, i);
+    } else {
+      COUNT(reads, i);
+    }
+    for (; i < batch; i++) {
+      if (write ? !dev_write(sector + i, iov[i].iov_base)
+                : !dev_read(sector + i, iov[i].iov_base)) {
+        return 0;
+      }
+    }
+    sector += batch;
+    iov += batch;
+    count -= batch;
+  }
+  return 1;
+}
+
+/* Parte da cache a que o setor pertence */
+static cache_shard *shard_of(int sector) {
+  return &shards[(unsigned int) sector * 2654435761u >> (32 - CACHE_SHARD_BITS)];
+}
+
+static int hash_sector(cache_shard *c, int sector) {
+  return (unsigned int) sector * 2654435761u & (c->buckets - 1);
+}
+
+static void lru_unlink(cache_shard *c, int e) {
+  cache_entry *cache = c->entries;
+
+  if (cache[e].prev != -1) {
+    cache[cache[e].prev].next = cache[e].next;
+  } else {
+    c->lru_head = cache[e].next;
+  }
+  if (cache[e].next != -1) {
+    cache[cache[e].next].prev = cache[e].prev;
+  } else {
+    c->lru_tail = cache[e].prev;
+  }
+}
+
+static void lru_push(cache_shard *c, int e) {
+  cache_entry *cache = c->entries;
+
+  cache[e].prev = -1;
+  cache[e].next = c->lru_head;
+  if (c->lru_head != -1) {
+    cache[c->lru_head].prev = e;
+  }
+  c->lru_head = e;
+  if (c->lru_tail == -1) {
+    c->lru_tail = e;
+  }
+}
+
+static int cache_lookup(cache_shard *c, int sector) {
+  int e;
+
+  for (e = c->hash[hash_sector(c, sector)]; e != -1; e = c->entries[e].hnext) {
+    if (c->entries[e].sector == sector) {
+      return e;
+    }
+  }
+  return -1;
+}
+
+static void hash_remove(cache_shard *c, int e) {
+  int *p = &c->hash[hash_sector(c, c->entries[e].sector)];
+
+  while (*p != e) {
+    p = &c->entries[*p].hnext;
+  }
+  *p = c->entries[e].hnext;
+}
+
+/* Obtém uma entrada livre para sector, despejando a menos usada se preciso. */
+static int cache_alloc(cache_shard *c, int sector) {
+  cache_entry *cache = c->entries;
+  int e, h;
+
+  if (c->used < c->size) {
+    e = c->used++;
+  } else {
+    e = c->lru_tail;
+    if (cache[e].dirty) {
+      if (!dev_write(cache[e].sector, &c->data[e * SECTORSIZE])) {
+        return -1;
+      }
+      COUNT(writebacks, 1);
+    }
+    lru_unlink(c, e);
+    hash_remove(c, e);
+    COUNT(evictions, 1);
+  }
+  cache[e].sector = sector;
+  cache[e].dirty = 0;
+  h = hash_sector(c, sector);
+  cache[e].hnext = c->hash[h];
+  c->hash[h] = e;
+  lru_push(c, e);
+  return e;
+}
+
+static void shard_free(cache_shard *c) {
+  free(c->entries);
+  free(c->data);
+  free(c->hash);
+  c->entries = NULL;
+  c->data = NULL;
+  c->hash = NULL;
+  c->size = c->used = 0;
+  c->lru_head = c->lru_tail = -1;
+}
+
+static int cache_flush();
+
+/* Configura a cache com o número de setores e a política de escrita
+ * desejados, divididos entre as partes. Zero setores desliga a cache. Os
+ * setores sujos são gravados com as travas de todas as partes já tomadas,
+ * para que nenhuma escrita entre na cache antiga depois da descarga. */
+int bl_cache_init(int sectors, int policy) {
+  int i, per, ok = 1;
+  cache_shard *c;
+
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    pthread_mutex_lock(&shards[i].lock);
+  }
+  if (!cache_flush()) {
+    for (i = CACHE_SHARDS - 1; i >= 0; i--) {
+      pthread_mutex_unlock(&shards[i].lock);
+    }
     return 0;
   }
-  if (fflush(stream) != 0) {
-    perror("Erro gravando setor no disco");
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    shard_free(&shards[i]);
+  }
+  cache_size = 0;
+  cache_policy = policy;
+
+  /* Com a imagem mapeada a cache de páginas do sistema já faz esse papel */
+  if (sectors > 0 && device_map == NULL) {
+    per = (sectors + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    for (i = 0; ok && i < CACHE_SHARDS; i++) {
+      c = &shards[i];
+      for (c->buckets = 1; c->buckets < 2 * per; c->buckets *= 2);
+      c->entries = malloc(per * sizeof(cache_entry));
+      c->data = malloc((size_t) per * SECTORSIZE);
+      c->hash = malloc(c->buckets * sizeof(int));
+      if (c->entries == NULL || c->data == NULL || c->hash == NULL) {
+        ok = 0;
+      } else {
+        memset(c->hash, -1, c->buckets * sizeof(int));
+        c->size = per;
+      }
+    }
+    if (!ok) {
+      printf("Memória insuficiente para a cache de setores\n");
+      for (i = 0; i < CACHE_SHARDS; i++) {
+        shard_free(&shards[i]);
+      }
+    } else {
+      cache_size = per * CACHE_SHARDS;
+    }
+  }
+  for (i = CACHE_SHARDS - 1; i >= 0; i--) {
+    pthread_mutex_unlock(&shards[i].lock);
+  }
+  return ok;
+}
+
+/* Guarda na cache uma cópia do setor escrito. Chamada com a trava da parte. */
+static int cache_store(cache_shard *c, int sector, char *buffer) {
+  int e = cache_lookup(c, sector);
+
+  if (e == -1) {
+    if ((e = cache_alloc(c, sector)) == -1) {
+      return 0;
+    }
+  } else {
+    lru_unlink(c, e);
+    lru_push(c, e);
+  }
+  memcpy(&c->data[e * SECTORSIZE], buffer, SECTORSIZE);
+  if (cache_policy == BL_WRITE_BACK) {
+    c->entries[e].dirty = 1;
+  }
+  c->write_gen++;
+  return 1;
+}
+
+/* Guarda na cache os count setores a partir de sector, já gravados na imagem
+ * (ou, com BL_WRITE_BACK, só na cache). */
+static int cache_store_all(int sector, int count, const struct iovec *iov) {
+  cache_shard *c;
+  int i, ok = 1;
+
+  for (i = 0; ok && i < count; i++) {
+    c = shard_of(sector + i);
+    pthread_mutex_lock(&c->lock);
+    ok = cache_store(c, sector + i, iov[i].iov_base);
+    pthread_mutex_unlock(&c->lock);
+  }
+  return ok;
+}
+
+/* Guarda na cache o setor lido da imagem sem a trava da parte, se nenhuma
+ * escrita tiver passado por ela desde gen. */
+static int cache_fill(cache_shard *c, unsigned long gen, int sector, char *buffer) {
+  int e, ok = 1;
+
+  pthread_mutex_lock(&c->lock);
+  if (c->write_gen == gen && cache_lookup(c, sector) == -1) {
+    if ((e = cache_alloc(c, sector)) == -1) {
+      ok = 0;
+    } else {
+      memcpy(&c->data[e * SECTORSIZE], buffer, SECTORSIZE);
+    }
+  }
+  pthread_mutex_unlock(&c->lock);
+  return ok;
+}
+
+/* Procura o setor na cache e, se ele estiver lá, copia-o para buffer.
+ * Numa falta, *gen recebe a versão da parte, para cache_fill. */
+static int cache_get(cache_shard *c, int sector, char *buffer, unsigned long *gen) {
+  int e;
+
+  pthread_mutex_lock(&c->lock);
+  e = cache_lookup(c, sector);
+  if (e != -1) {
+    COUNT(hits, 1);
+    lru_unlink(c, e);
+    lru_push(c, e);
+    memcpy(buffer, &c->data[e * SECTORSIZE], SECTORSIZE);
+  } else {
+    COUNT(misses, 1);
+    *gen = c->write_gen;
+  }
+  pthread_mutex_unlock(&c->lock);
+  return e != -1;
+}
+
+int bl_write(int sector, char *buffer) {
+  struct iovec iov;
+
+  STATS_OP(ST_BL_WRITE);
+  STATS_BYTES(SECTORSIZE);
+  if (device_map != NULL) {
+    return map_xfer(1, sector, buffer);
+  }
+
+  if (cache_size == 0) {
+    return dev_write(sector, buffer);
+  }
+
+  iov.iov_base = buffer;
+  iov.iov_len = SECTORSIZE;
+  return (cache_policy == BL_WRITE_BACK || dev_write(sector, buffer)) && cache_store_all(sector, 1, &iov);
+}
+
+int bl_read(int sector, char *buffer) {
+  cache_shard *c;
+  unsigned long gen;
+
+  STATS_OP(ST_BL_READ);
+  STATS_BYTES(SECTORSIZE);
+  if (device_map != NULL) {
+    return map_xfer(0, sector, buffer);
+  }
+
+  if (cache_size == 0) {
+    return dev_read(sector, buffer);
+  }
+
+  c = shard_of(sector);
+  if (cache_get(c, sector, buffer, &gen)) {
+    return 1;
+  }
+  return dev_read(sector, buffer) && cache_fill(c, gen, sector, buffer);
+}
+
+/* Escreve count setores consecutivos a partir de sector. Cada elemento de
+ * iov deve apontar para um setor inteiro (SECTORSIZE bytes). */
+int bl_writev(int sector, int count, const struct iovec *iov) {
+  int i;
+
+  STATS_OP(ST_BL_WRITEV);
+  STATS_BYTES((long long) count * SECTORSIZE);
+  if (device_map != NULL) {
+    for (i = 0; i < count; i++) {
+      if (!map_xfer(1, sector + i, iov[i].iov_base)) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+
+  if (cache_size == 0) {
+    return dev_xfer(1, sector, iov, count);
+  }
+
+  return (cache_policy == BL_WRITE_BACK || dev_xfer(1, sector, iov, count)) &&
+         cache_store_all(sector, count, iov);
+}
+
+/* Lê count setores consecutivos a partir de sector. Os setores presentes na
+ * cache são copiados dela; as sequências de faltas são lidas do disco com
+ * uma única chamada cada. */
+int bl_readv(int sector, int count, const struct iovec *iov) {
+  unsigned long gen[CACHE_SHARDS], g;
+  unsigned int seen;
+  cache_shard *c;
+  int i, j;
+
+  STATS_OP(ST_BL_READV);
+  STATS_BYTES((long long) count * SECTORSIZE);
+  if (device_map != NULL) {
+    for (i = 0; i < count; i++) {
+      if (!map_xfer(0, sector + i, iov[i].iov_base)) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+
+  if (cache_size == 0) {
+    return dev_xfer(0, sector, iov, count);
+  }
+
+  for (i = 0; i < count; ) {
+    if (cache_get(shard_of(sector + i), sector + i, iov[i].iov_base, &g)) {
+      i++;
+      continue;
+    }
+
+    /* Sequência de faltas. A versão de cada parte é a da primeira falta nela,
+     * a mais antiga. */
+    seen = 0;
+    for (j = i; j < count; j++) {
+      c = shard_of(sector + j);
+      if (j > i && cache_get(c, sector + j, iov[j].iov_base, &g)) {
+        break;
+      }
+      if (!(seen & 1u << (c - shards))) {
+        seen |= 1u << (c - shards);
+        gen[c - shards] = g;
+      }
+    }
+    if (!dev_xfer(0, sector + i, &iov[i], j - i)) {
+      return 0;
+    }
+    for (; i < j; i++) {
+      c = shard_of(sector + i);
+      if (!cache_fill(c, gen[c - shards], sector + i, iov[i].iov_base)) {
+        return 0;
+      }
+    }
+    i = j < count ? j + 1 : j;  /* O setor que encerrou a sequência veio da cache */
+  }
+  return 1;
+}
+
+typedef struct {
+  int sector;
+  char *data;
+  char *dirty;
+} dirty_sector;
+
+static int compare_sector(const void *a, const void *b) {
+  return ((const dirty_sector *) a)->sector - ((const dirty_sector *) b)->sector;
+}
+
+/* Grava no disco os setores sujos da cache, em ordem de setor e agrupando
+ * setores consecutivos (de partes diferentes) numa única escrita. Chamada
+ * com as travas de todas as partes. */
+static int cache_flush() {
+  dirty_sector *dirty;
+  struct iovec *iov;
+  int ndirty, e, i, j, s;
+
+  dirty = malloc(cache_size * sizeof(dirty_sector) + 1);
+  iov = malloc(cache_size * sizeof(struct iovec) + 1);
+  if (dirty == NULL || iov == NULL) {
+    free(dirty);
+    free(iov);
+    printf("Memória insuficiente para descarregar a cache\n");
     return 0;
   }
+
+  ndirty = 0;
+  for (s = 0; s < CACHE_SHARDS; s++) {
+    for (e = 0; e < shards[s].used; e++) {
+      if (shards[s].entries[e].dirty) {
+        dirty[ndirty].sector = shards[s].entries[e].sector;
+        dirty[ndirty].data = &shards[s].data[e * SECTORSIZE];
+        dirty[ndirty].dirty = &shards[s].entries[e].dirty;
+        ndirty++;
+      }
+    }
+  }
+  qsort(dirty, ndirty, sizeof(dirty_sector), compare_sector);
+
+  for (i = 0; i < ndirty; i = j) {
+    for (j = i; j < ndirty && dirty[j].sector == dirty[i].sector + (j - i); j++) {
+      iov[j - i].iov_base = dirty[j].data;
+      iov[j - i].iov_len = SECTORSIZE;
+    }
+    if (!dev_xfer(1, dirty[i].sector, iov, j - i)) {
+      free(dirty);
+      free(iov);
+      return 0;
+    }
+    for (e = i; e < j; e++) {
+      *dirty[e].dirty = 0;
+    }
+    COUNT(writebacks, j - i);
+  }
+
+  free(dirty);
+  free(iov);
   return 1;
 }
 
-int bl_read(int sector, char *buffer){
-  if (fseek(stream, sector * SECTORSIZE, SEEK_SET) == -1) {
-    perror("Erro posicionando setor para leitura");
+/* Grava no disco todos os setores sujos da cache e espera que tudo o que
+ * foi escrito chegue ao disco. Com a imagem mapeada, sincroniza o
+ * mapeamento com msync. */
+int bl_sync() {
+  int i, ok;
+
+  STATS_OP(ST_BL_SYNC);
+  if (device_map != NULL) {
+    if (msync(device_map, device_size, MS_SYNC) == -1) {
+      perror("Sincronizando imagem mapeada");
+      return 0;
+    }
+    return 1;
+  }
+
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    pthread_mutex_lock(&shards[i].lock);
+  }
+  ok = cache_flush();
+  for (i = CACHE_SHARDS - 1; i >= 0; i--) {
+    pthread_mutex_unlock(&shards[i].lock);
+  }
+  if (!ok) {
     return 0;
   }
-  if (fread(buffer, sizeof(char), SECTORSIZE, stream) != SECTORSIZE) {
-    perror("Erro lendo setor");
+
+  if (fdatasync(device_fd) == -1) {
+    perror("Sincronizando imagem");
     return 0;
   }
   return 1;
 }
+
+void bl_get_stats(bl_cache_stats *s) {
+  s->hits = __atomic_load_n(&stats.hits, __ATOMIC_RELAXED);
+  s->misses = __atomic_load_n(&stats.misses, __ATOMIC_RELAXED);
+  s->evictions = __atomic_load_n(&stats.evictions, __ATOMIC_RELAXED);
+  s->writebacks = __atomic_load_n(&stats.writebacks, __ATOMIC_RELAXED);
+  s->reads = __atomic_load_n(&stats.reads, __ATOMIC_RELAXED);
+  s->writes = __atomic_load_n(&stats.writes, __ATOMIC_RELAXED);
+}
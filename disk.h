@@ -20,9 +20,37 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/uio.h>
+
 #define SECTORSIZE 4096
 
-int bl_init(char *file, int size);
+/* Opções de bl_init */
+#define BL_MMAP 1      /* Mapeia a imagem em memória (acesso sem cópia via bl_map) */
+
+/* Políticas de escrita da cache de setores */
+#define BL_WRITE_THROUGH 0
+#define BL_WRITE_BACK 1
+
+/* Contadores da cache de setores e das transferências com a imagem */
+typedef struct {
+  long hits;
+  long misses;
+  long evictions;
+  long writebacks;
+  long reads;        /* Setores lidos da imagem (faltas, leituras sem cache e bl_map_read) */
+  long writes;       /* Setores gravados na imagem */
+} bl_cache_stats;
+
+int bl_init(char *file, int size, int flags);
 int bl_size();
 int bl_write(int sector, char* buffer);
 int bl_read(int sector, char* buffer);
+int bl_writev(int sector, int count, const struct iovec *iov);
+int bl_readv(int sector, int count, const struct iovec *iov);
+char *bl_map(int sector);
+int bl_map_read(int sector, int offset, char *buffer, int n);
+char *bl_map_private(int sector, int count);
+void bl_unmap(char *p, int count);
+int bl_cache_init(int sectors, int policy);
+int bl_sync();
+void bl_get_stats(bl_cache_stats *stats);
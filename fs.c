@@ -22,178 +22,3753 @@
 
 /*
 bl_write escreve SECTORZISE bytes
-4kiB = 1 setor = 4096 bytes
-Setores
-FAT -> 32 setores [0-31]
-DIR -> 1 setor [32]
-ARQUIVOS -> [33+]
+1 setor = 4096 bytes; 1 cluster = 1 a 16 setores (4 a 64 KiB), escolhido na formatação
+Clusters
+SUPERBLOCO -> cluster 0 (setor 0)
+FAT -> clusters [1-F], uma entrada de 16 ou 32 bits por cluster da imagem
+DIR -> cluster F+1 (e os que forem encadeados a ele)
+JOURNAL -> clusters seguintes, com espaço para um grupo que altere a FAT inteira
+ARQUIVOS -> resto da imagem
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/uio.h>
 
 #include "disk.h"
 #include "fs.h"
+#include "lz.h"
+#include "stats.h"
+
+#define IOVBATCH 64          // Setores transferidos por chamada vetorizada
+
+//Valores especiais das entradas da FAT. A FAT de 16 bits guarda só os 16 bits de
+//baixo; na leitura, valores a partir de 0xFFF0 são estendidos para estes.
+#define FAT_FREE 0
+#define FAT_EOF 0xFFFFFFFFu		// Último cluster de um arquivo
+#define FAT_RESERVED 0xFFFFFFFEu	// Superbloco e FAT
+#define DIREND 0xFFFFFFFDu		// Marca o fim da cadeia de clusters do diretório
+#define JOURNALMARK 0xFFFFFFFCu		// Marca os clusters do journal
+#define DEDUPDATA 0xFFFFFFFBu		// Cluster de dados deduplicado (referências no índice de conteúdo)
+#define DEDUPINDEX 0xFFFFFFFAu		// Cluster do índice de conteúdo gravado no disco
+
+#define FAT16_MAX 0xFFF0	// Clusters endereçáveis pela FAT de 16 bits
+#define FAT32_MAX 0x7FFFFFF0	// e pela de 32 bits (os clusters são int)
+#define DEFAULT_FAT_BITS 16
+#define DEFAULT_CLUSTER_SIZE SECTORSIZE
+#define MAX_CLUSTER_SIZE (16 * SECTORSIZE)
+
+//Geometria da imagem, escolhida em fs_format e guardada no superbloco
+int fat_bits = DEFAULT_FAT_BITS;	//Largura das entradas da FAT
+int cluster_sectors = 1;	//Setores por cluster
+int cluster_size = SECTORSIZE;	//Bytes por cluster
+int fat_entries = 0;		//Entradas da FAT, uma por cluster da imagem
+int fat_sectors = 0;		//Setores ocupados pela FAT
+int fat_per_sector = 0;		//Entradas da FAT em cada setor
+int dir_start = 0;		//Primeiro cluster do diretório, logo depois da FAT
+int journal_start = 0;		//Primeiro setor do journal, logo depois do diretório
+int journal_sectors = 0;	//Setores do journal
+
+//A FAT e o diretório ficam em cópias na memória mesmo com a imagem mapeada
+//(bl_map): seus setores no disco só podem ser alterados depois que as
+//alterações estiverem no journal. Os dados dos arquivos usam o mapeamento.
+//A FAT fica no formato do disco e é lida com fat_get.
+char *fat = NULL;
+int fat_mapped = 0;	//A FAT é um mapeamento privado da imagem (bl_map_private)
+int mapped = 0;
+
+//Setores da FAT alterados em memória e ainda não escritos no disco
+char *fat_dirty = NULL;
+
+//Entrada do diretório, com 64 bytes
+typedef struct {
+  char used;
+  char name[25];
+  char flags;
+  char pad;
+  unsigned int first_block;
+  long long size;
+  unsigned int index_block;	//Cadeia do índice de grupos de um arquivo comprimido (0 = nenhuma)
+  char reserved[20];
+} dir_entry;
+
+#define DIR_COMPRESSED 1	// flags: o arquivo é gravado em grupos comprimidos
+#define DIR_DEDUP 2		// flags: os clusters do arquivo são deduplicados
+#define DIR_CLUSTERMAP 4	// flags: os clusters de uma cópia ficam listados num mapa
+
+int dir_per_cluster = 0;	//Entradas do diretório por cluster
+
+//O diretório é uma cadeia de clusters na FAT que começa em dir_start e termina
+//com DIREND; ela cresce quando todas as entradas estão ocupadas. Cada cluster
+//(um "setor" do diretório) fica numa cópia em memória.
+dir_entry **dir_sectors = NULL;
+int dir_cap = 0;		//Posições de dir_sectors
+int *dir_clusters = NULL;	//Cluster de cada setor do diretório
+char *dir_dirty = NULL;		//Setores do diretório ainda não escritos no disco
+int dir_nsectors = 0;
+int dir_entries = 0;		//Total de entradas (dir_nsectors * dir_per_cluster)
+
+//O vetor dir_sectors é trocado quando o diretório cresce (ver add_dir_sector), e
+//pode ser lido sem trava
+#define DIR_SECTOR(i) (__atomic_load_n(&dir_sectors, __ATOMIC_ACQUIRE)[(i) / dir_per_cluster])
+#define ENTRY(i) (DIR_SECTOR(i)[(i) % dir_per_cluster])
+
+#define SUPERBLOCK 0		// Setor do superbloco, no início da imagem
+#define SUPERMAGIC 0x53465352	// "RSFS"
+#define SUPERVERSION 5
+
+#define JOURNALSHARE 128	// Os blocos ocupam 1/JOURNALSHARE da imagem antes do checkpoint,
+#define JOURNALMIN 4		// no mínimo JOURNALMIN setores
+#define JOURNALMAX 1024		// e no máximo JOURNALMAX
+#define JOURNALMAGIC 0x4a534652	// "RSFJ"
+#define JOURNALGROUP 8		// Setores de registros acumulados antes de irem para o journal (no máximo)
+
+//Journal das alterações da FAT e do diretório. O primeiro setor guarda a geração
+//atual; depois dele vêm os blocos gravados, cada um com um cabeçalho e os valores
+//novos das entradas alteradas. Os setores de origem da FAT e do diretório só são
+//atualizados no checkpoint, quando os blocos passam de journal_limit setores; então
+//a geração muda e os blocos antigos deixam de valer. Depois desses setores o journal
+//ainda tem espaço para o maior grupo possível (journal_group_max), de modo que todo
+//grupo vai para o journal antes de chegar aos setores de origem.
+typedef struct {
+  unsigned int magic;
+  unsigned int seq;		//Geração do journal
+  int sectors;			//Setores do bloco, incluindo o do cabeçalho
+  int nfat;			//Registros da FAT, logo depois do cabeçalho
+  int ndir;			//Registros do diretório, depois dos da FAT
+  unsigned int checksum;	//Do bloco inteiro, calculado com este campo zerado
+} journal_header;
+
+typedef struct {
+  unsigned int index;
+  unsigned int value;
+} journal_fat;
+
+typedef struct {
+  int slot;
+  dir_entry entry;
+} journal_dir;
+
+//Superbloco: identifica a imagem e sua geometria. Com clean, a imagem foi desmontada
+//por fs_shutdown (journal vazio e contador de livres exato) e a montagem lê só este
+//setor; caso contrário, a FAT é lida inteira, o journal é refeito e os livres recontados.
+typedef struct {
+  unsigned int magic;
+  int version;
+  int sector_size;
+  int sectors;			//Tamanho da imagem
+  int fat_bits;
+  int cluster_sectors;
+  int fat_sectors;
+  int fat_entries;
+  int dir_start;
+  int journal_start;
+  int journal_sectors;
+  unsigned int journal_seq;	//Geração atual do journal
+  int free_clusters;
+  int shared_clusters;		//Clusters com mais de uma referência (cópias por fs_clone)
+  unsigned int dedup_block;	//Primeiro cluster do índice de conteúdo (0 = nenhum)
+  int clean;
+  unsigned int checksum;	//Do superbloco inteiro, calculado com este campo zerado
+} superblock;
+
+int sb_clean = 0;	//O superbloco no disco diz que a imagem está limpa
+
+unsigned int journal_seq = 0;
+int journal_pos = 1;	//Próximo setor livre do journal
+
+//Setores ocupados pelos blocos antes do checkpoint, proporcionais à imagem, e setores
+//de registros acumulados antes de irem para o journal (JOURNALGROUP, ou metade de
+//journal_limit numa imagem pequena)
+int journal_limit = 0;
+int journal_group = 0;
+
+//Setores do maior grupo possível. Uma operação que altera muitas entradas da FAT
+//(remover ou gravar um arquivo grande) manda o grupo para o journal ao chegar a
+//2 * journal_group setores (ver fat_set), então o journal não precisa comportar um
+//grupo que reescreva a FAT inteira; o setor a mais cobre as entradas do diretório
+//alteradas entre duas alterações da FAT.
+int journal_group_max = 0;
+
+//Entradas alteradas desde o último bloco gravado no journal (o grupo em memória).
+//Cada entrada aparece uma só vez; o valor gravado é o que ela tiver no momento.
+int *journal_fats = NULL;
+int journal_nfat = 0;
+unsigned long long *journal_fat_mark = NULL;
+int *journal_dirs = NULL;
+int journal_ndir = 0;
+char *journal_dir_mark = NULL;
+
+int formatado = 0;
+
+
+#define MAXOPEN 32	// Arquivos abertos ao mesmo tempo
+#define WRITEBATCH 16	// Clusters acumulados pela escrita antes de irem para o disco
+#define READAHEAD 16	// Máximo de clusters lidos antecipadamente numa leitura sequencial
+
+//Trecho contíguo de um arquivo: seus clusters lógicos lcn..lcn+len-1
+//ficam nos clusters block..block+len-1 do disco
+typedef struct{
+  int lcn;
+  int block;
+  int len;
+} extent;
+
+//Arquivos comprimidos são divididos em grupos de WRITEBATCH clusters lógicos (o
+//tamanho do buffer de escrita), comprimidos de forma independente para que uma
+//posição qualquer seja lida descomprimindo só o seu grupo. Cada grupo ocupa
+//clusters inteiros da cadeia do arquivo, a partir do cluster lógico lcn; um grupo
+//que não diminui com a compressão é gravado como está (bytes == length).
+typedef struct{
+  int lcn;
+  int clusters;		//Clusters da cadeia reservados ao grupo (podem sobrar depois de uma regravação)
+  int bytes;		//Bytes gravados
+  int length;		//Bytes do grupo descomprimido
+} zgroup;
+
+#define GROUP_SIZE (WRITEBATCH * cluster_size)
+
+//Arquivos com deduplicação guardam na sua cadeia da FAT só o mapa dos clusters: o
+//cluster físico de cada cluster lógico e o hash do conteúdo dele. Os clusters de dados
+//(DEDUPDATA na FAT) podem ser de vários arquivos e têm referências contadas no índice
+//de conteúdo. Uma cópia feita por fs_clone passa a ter um mapa igual (DIR_CLUSTERMAP,
+//com hash 0) na primeira alteração; os clusters dela têm referências contadas na
+//tabela de compartilhados.
+typedef struct{
+  int cluster;
+  unsigned int hash;
+} dmap_entry;
+
+//Tabela de arquivos abertos. O descritor devolvido por fs_open é o índice nesta
+//tabela; cada um tem seu próprio modo, cursor, buffer e posição na cadeia da FAT,
+//de modo que vários arquivos podem ser lidos e escritos ao mesmo tempo.
+typedef struct{
+  int used;
+  int slot;		//Entrada do arquivo no diretório
+  int mode;		//FS_R, FS_W, FS_A ou FS_RW
+  long long pos;	//Cursor de fs_read e fs_write (movido por fs_seek)
+  long long size;	//Tamanho de um arquivo aberto só para leitura (não muda enquanto ele está aberto)
+  char *janela;		//Janela de leitura
+  char *conteudo;	//Buffer de escrita
+
+  //Mapa da cadeia da FAT em trechos contíguos, ordenados pelo cluster lógico.
+  //É montado na abertura e estendido a cada cluster acrescentado ao arquivo,
+  //então traduzir uma posição não exige percorrer a cadeia.
+  extent *map;
+  int map_len;
+  int map_cap;
+  int map_hint;		//Último trecho consultado
+
+  //Leitura: apenas uma janela de clusters do arquivo fica em memória
+  long long win_start;	//Posição no arquivo do início da janela
+  int win_len;		//Bytes válidos na janela
+  int ra;		//Clusters a ler na próxima leitura antecipada
+
+  //Escrita: o fim do arquivo fica no buffer até completar WRITEBATCH clusters,
+  //que são então gravados nos clusters do arquivo.
+  int buf_lcn;		//Cluster lógico do início do buffer
+  int len;		//Bytes no buffer
+  int dirty_from;	//Primeiro byte do buffer alterado desde a última gravação
+  int blocks;		//Clusters da cadeia do arquivo
+  int last_block;	//Último cluster da cadeia do arquivo
+  int ext_next;		//Clusters reservados (contíguos) e ainda não usados
+  int ext_left;
+  int shared_from;	//Primeiro cluster lógico compartilhado com outra cópia (ou NOT_SHARED)
+
+  //Arquivo comprimido: o índice dos grupos fica em memória enquanto ele está aberto
+  int compressed;
+  zgroup *groups;
+  int ngroups;
+  int groups_cap;
+  int index_dirty;	//O índice mudou e precisa ser gravado no fechamento
+  char *zbuf;		//Um grupo comprimido (ou um cluster lido para comparação, na deduplicação)
+
+  //Arquivo com deduplicação: o mapa fica em memória enquanto ele está aberto
+  int dedup;
+  dmap_entry *dmap;	//Um registro por cluster lógico (blocks registros)
+  int dmap_cap;
+  int dmap_dirty;	//O mapa mudou e precisa ser gravado no fechamento
+  int map_stale;	//O mapa de trechos (map) não corresponde mais a dmap
+  int *dead;		//Clusters que ficaram sem referências, liberados no fechamento
+  int ndead;
+  int dead_cap;
+
+  //Cópia com mapa de clusters: usa dmap e dead como um arquivo com deduplicação
+  int clustermap;
+} open_file;
+
+#define NOT_SHARED INT_MAX
+
+open_file files[MAXOPEN];
+
+//Estado de cada entrada do diretório que não vai para o disco. Ele fica logo depois
+//das entradas, no mesmo bloco de memória do setor (ver add_dir_sector), que não muda
+//de lugar quando o diretório cresce.
+typedef struct {
+  int open_count;	//Descritores abertos para leitura, ou -1 se aberto para escrita
+  int hash_next;	//Próxima entrada no mesmo balde do índice de nomes, ou -1
+} dir_slot;
+
+#define SLOT(i) (((dir_slot *) &DIR_SECTOR(i)[dir_per_cluster])[(i) % dir_per_cluster])
+
+//Sincronização entre threads. As travas são sempre tomadas nesta ordem:
+//- a trava do descritor, em file_locks: o estado dele (cursor, janela, buffer, mapa)
+//  e os campos used, slot e mode;
+//- as travas de nomes, em name_locks, escolhidas pelo hash do nome: criar, remover,
+//  copiar, abrir e fechar um arquivo travam o nome dele (fs_clone os dois nomes, na
+//  ordem das travas), e o open_count de uma entrada só muda com o nome dela travado;
+//- dir_mutex, a estrutura do diretório: entradas usadas e seus nomes, o índice de
+//  nomes e o crescimento do diretório;
+//- alloc_mutex, os demais metadados: FAT e alocação, o conteúdo das entradas, o
+//  journal e as tabelas de compartilhados e da deduplicação. Quem muda a estrutura do
+//  diretório tem também alloc_mutex, porque a entrada e seus clusters vão juntos para
+//  o journal;
+//- as travas da cache de setores (disk.c).
+//Assim a procura de um nome (dir_lookup) não espera pelas escritas nos arquivos, e
+//threads com descritores diferentes só disputam alloc_mutex. Os dados de um arquivo
+//são transferidos sem alloc_mutex: seus clusters já estão reservados para o descritor.
+//Um cluster novo só é ligado à cadeia (e o tamanho só cresce) depois que seus dados
+//foram gravados, então a FAT que fs_sync ou um checkpoint põem no journal nesse meio
+//tempo nunca aponta para um cluster com conteúdo antigo.
+//fs_init, fs_format e fs_shutdown não podem ser chamadas junto com outras funções.
+pthread_mutex_t file_locks[MAXOPEN] = {[0 ... MAXOPEN - 1] = PTHREAD_MUTEX_INITIALIZER};
+
+//Descritores em uso ou sendo abertos. fs_open reserva um descritor trocando o seu
+//indicador de 0 para 1, sem trava; close_file o devolve depois de limpar used.
+char file_taken[MAXOPEN];
+
+#define NAMELOCKS 64	// Travas de nomes (potência de 2)
+pthread_mutex_t name_locks[NAMELOCKS] = {[0 ... NAMELOCKS - 1] = PTHREAD_MUTEX_INITIALIZER};
+
+//Trava com seqlock: seq é ímpar enquanto a trava está com alguém. Quem só consulta o
+//que ela protege (dir_lookup, fs_list) lê sem trava e repete a leitura se seq mudar.
+typedef struct {
+  pthread_mutex_t mutex;
+  unsigned int seq;
+} seqlock;
+
+seqlock dir_mutex = {PTHREAD_MUTEX_INITIALIZER, 0};
+seqlock alloc_mutex = {PTHREAD_MUTEX_INITIALIZER, 0};
+#define READ_TRIES 4	// Tentativas sem trava antes de esperar pela trava
+
+//Vetores de dir_sectors e índices de nomes substituídos no crescimento do diretório (e
+//setores descartados), que um leitor sem trava ainda pode estar usando. São liberados
+//em release_dir.
+void **retired = NULL;
+int nretired = 0;
+
+#define DIRHASH 256	// Baldes mínimos do índice de nomes (potência de 2)
+
+//Índice em memória dos nomes do diretório: tabela hash com encadeamento, com a
+//primeira entrada de cada balde em bucket e a seguinte em SLOT(i).hash_next. A tabela
+//dobra de tamanho quando o diretório passa a ter mais entradas que baldes; a nova é
+//montada à parte e publicada pronta.
+typedef struct {
+  int size;		//Baldes
+  int bucket[];
+} dir_index;
+
+dir_index *dir_hash = NULL;
+int dir_free_hint = 0;	//Primeira entrada do diretório que pode estar livre
+
+
+int FatDirSize = 0;	//Primeiro cluster de dados, logo depois do journal
+
+//Mapa de bits dos clusters livres (bit 1 = livre) e contador de clusters livres
+unsigned long long *free_map = NULL;
+int free_clusters = 0;
+int free_hint = 0;
+int data_clusters = 0;	//Clusters existentes na imagem (limitado ao tamanho da FAT)
+int free_map_ready = 0;	//O mapa de bits só é montado na primeira alocação
+
+//Clusters liberados no grupo em memória. Eles contam como livres, mas só voltam ao
+//mapa de bits quando o grupo chega ao journal: antes disso uma queda desfaz a
+//liberação, e o arquivo que os tinha volta a apontar para o conteúdo deles.
+int *freed = NULL;
+int nfreed = 0;
+
+//Clusters compartilhados entre cópias de um arquivo (fs_clone). Uma cópia aponta para
+//o primeiro cluster do original, e as cadeias seguem juntas até que uma delas seja
+//alterada. As referências a cada cluster (entradas do diretório e da FAT que apontam
+//para ele) ficam numa tabela hash com endereçamento aberto, só para os que têm mais
+//de uma; enquanto ela não é montada, share_len vem do superbloco.
+int *share_key = NULL;		//Cluster, ou -1 numa posição vazia
+int *share_refs_of = NULL;	//Referências ao cluster
+int share_cap = 0;		//Posições da tabela (potência de 2)
+int share_len = 0;		//Clusters compartilhados (lido sem trava por fs_list)
+int share_ready = 0;
+
+//Índice de conteúdo da deduplicação: tabela hash com endereçamento aberto, pelo hash
+//do conteúdo, com as referências a cada cluster de dados deduplicado. No disco, ele é
+//gravado no desligamento em clusters marcados com DEDUPINDEX, encadeados pelo
+//cabeçalho de cada um, a partir de dedup_block; depois de uma queda, é refeito a
+//partir dos mapas dos arquivos.
+typedef struct {
+  unsigned int hash;
+  int cluster;		//-1 numa posição vazia
+  int refs;
+} dedup_entry;
+
+typedef struct {
+  unsigned int next;	//Próximo cluster do índice (0 no último)
+  int count;		//Registros neste cluster
+} dedup_header;
+
+dedup_entry *dedup_table = NULL;
+int dedup_cap = 0;		//Posições da tabela (potência de 2)
+int dedup_len = 0;		//Clusters de dados no índice
+long long dedup_total = 0;	//Referências a eles (clusters lógicos dos arquivos)
+int dedup_ready = 0;		//O índice está em memória
+int dedup_dirty = 0;		//O índice mudou desde que foi gravado
+unsigned int dedup_block = 0;
+
+/*FUNÇÕES AUXILIARES*/
+
+void seq_lock(seqlock *l)
+{
+	pthread_mutex_lock(&l->mutex);
+	__atomic_store_n(&l->seq, l->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void seq_unlock(seqlock *l)
+{
+	__atomic_store_n(&l->seq, l->seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&l->mutex);
+}
+
+//Início de uma leitura sem trava: a versão atual do que l protege (ímpar se estiver
+//sendo alterado)
+unsigned int seq_read_begin(seqlock *l)
+{
+	return __atomic_load_n(&l->seq, __ATOMIC_ACQUIRE);
+}
+
+//Indica se a leitura iniciada na versão seq pode ter visto dados pela metade
+int seq_read_retry(seqlock *l, unsigned int seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (seq & 1) || __atomic_load_n(&l->seq, __ATOMIC_RELAXED) != seq;
+}
+
+void alloc_lock()
+{
+	seq_lock(&alloc_mutex);
+}
+
+void alloc_unlock()
+{
+	seq_unlock(&alloc_mutex);
+}
+
+void dir_lock()
+{
+	seq_lock(&dir_mutex);
+}
+
+void dir_unlock()
+{
+	seq_unlock(&dir_mutex);
+}
+
+//Guarda p para ser liberado em release_dir (sem memória para isso, p nunca é liberado)
+void retire(void *p)
+{
+	void **list = realloc(retired, (nretired + 1) * sizeof(void *));
+	if(list == NULL) return;
+
+	retired = list;
+	retired[nretired++] = p;
+}
+
+int grow_dir();
+int load_dir();
+int format_image(int fat_width, int cluster_bytes);
+
+//Acha a primeira entrada livre do diretório, a partir da primeira que pode estar livre.
+//Com o diretório cheio, ele ganha mais um setor.
+int find_first_empty_dir()
+{
+  	for (int i = dir_free_hint; i < dir_entries; i++)
+  	{
+    	if(ENTRY(i).used == 0){
+    		dir_free_hint = i;
+    		return i;
+    	}
+  	}
+
+  	dir_free_hint = dir_entries;
+  	return grow_dir();
+}
+
+//Hash FNV-1a de um bloco de bytes, usado para validar os blocos do journal
+unsigned int checksum(char *data, int len)
+{
+	unsigned int h = 2166136261u;
+
+	for (int i = 0; i < len; i++)
+	{
+		h = (h ^ (unsigned char) data[i]) * 16777619u;
+	}
+
+	return h;
+}
+
+//Hash FNV-1a do nome do arquivo
+unsigned int name_hash(char *name)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *name; name++)
+	{
+		h = (h ^ (unsigned char) *name) * 16777619u;
+	}
+
+	return h;
+}
+
+//Trava o nome file_name. Devolve a trava usada, que é passada a name_unlock.
+int name_lock(char *file_name)
+{
+	int k = name_hash(file_name) & (NAMELOCKS - 1);
+
+	pthread_mutex_lock(&name_locks[k]);
+	return k;
+}
+
+void name_unlock(int k)
+{
+	pthread_mutex_unlock(&name_locks[k]);
+}
+
+//Trava os nomes a e b na ordem das travas, e uma vez só se os dois caírem na mesma.
+//As travas usadas ficam em k, que é passado a name_unlock2.
+void name_lock2(char *a, char *b, int k[2])
+{
+	k[0] = name_hash(a) & (NAMELOCKS - 1);
+	k[1] = name_hash(b) & (NAMELOCKS - 1);
+	if(k[0] > k[1]){
+		int t = k[0];
+		k[0] = k[1];
+		k[1] = t;
+	}
+
+	pthread_mutex_lock(&name_locks[k[0]]);
+	if(k[1] != k[0]) pthread_mutex_lock(&name_locks[k[1]]);
+}
+
+void name_unlock2(int k[2])
+{
+	if(k[1] != k[0]) pthread_mutex_unlock(&name_locks[k[1]]);
+	pthread_mutex_unlock(&name_locks[k[0]]);
+}
+
+//Balde do nome no índice
+int *index_bucket(dir_index *index, char *name)
+{
+	return &index->bucket[name_hash(name) & (index->size - 1)];
+}
+
+void dir_index_insert(int slot)
+{
+	int *bucket = index_bucket(dir_hash, ENTRY(slot).name);
+
+	SLOT(slot).hash_next = *bucket;
+	*bucket = slot;
+}
+
+void dir_index_remove(int slot)
+{
+	int *p = index_bucket(dir_hash, ENTRY(slot).name);
+
+	while(*p != -1 && *p != slot) p = &SLOT(*p).hash_next;
+	if(*p == slot) *p = SLOT(slot).hash_next;
+
+	if(slot < dir_free_hint) dir_free_hint = slot;
+}
+
+//Reconstrói o índice de nomes a partir das entradas usadas do diretório, com pelo
+//menos um balde por entrada. O índice anterior fica para os leitores sem trava.
+int build_dir_index()
+{
+	int size = DIRHASH;
+	while(size < dir_entries) size *= 2;
+
+	dir_index *index = malloc(sizeof(dir_index) + size * sizeof(int));
+	if(index == NULL){
+		printf("Erro: Memória insuficiente para o índice do diretório\n");
+		return 0;
+	}
+	index->size = size;
+	memset(index->bucket, -1, size * sizeof(int));
+	dir_free_hint = 0;
+
+	for (int i = dir_entries - 1; i >= 0; i--)
+	{
+		if(ENTRY(i).used){
+			int *bucket = index_bucket(index, ENTRY(i).name);
+			SLOT(i).hash_next = *bucket;
+			*bucket = i;
+		}
+	}
+
+	if(dir_hash != NULL) retire(dir_hash);
+	__atomic_store_n(&dir_hash, index, __ATOMIC_RELEASE);
+	return 1;
+}
+
+//Procura o nome no índice, sem trava. Devolve a entrada, -1 se o nome não estiver no
+//índice ou -2 se o índice mudou durante a procura e a cadeia do balde não faz sentido
+//(uma entrada além do diretório, ou mais passos que entradas).
+int index_find(char *file_name)
+{
+	int entries = __atomic_load_n(&dir_entries, __ATOMIC_ACQUIRE);
+	dir_index *index = __atomic_load_n(&dir_hash, __ATOMIC_ACQUIRE);
+	int steps = 0;
+
+	for (int i = *index_bucket(index, file_name); i != -1; i = SLOT(i).hash_next)
+	{
+		if(i < 0 || i >= entries || ++steps > entries) return -2;
+		if(!strncmp(ENTRY(i).name, file_name, sizeof(ENTRY(i).name))) return i;
+	}
+
+	return -1;
+}
+
+//Procura o arquivo pelo nome no índice. Devolve a entrada do diretório ou -1.
+//A procura é feita sem trava e validada pelo seqlock de dir_mutex; depois de
+//READ_TRIES tentativas, é feita com a trava. Por isso não pode ser chamada com
+//dir_mutex ou alloc_mutex travados. O resultado só vale enquanto o nome estiver
+//travado (name_lock).
+int dir_lookup(char *file_name)
+{
+	for (int t = 0; t < READ_TRIES; t++)
+	{
+		unsigned int seq = seq_read_begin(&dir_mutex);
+		if(!(seq & 1)){
+			int i = index_find(file_name);
+			if(!seq_read_retry(&dir_mutex, seq)) return i;
+		}
+		sched_yield();
+	}
+
+	dir_lock();
+	int i = index_find(file_name);
+	dir_unlock();
+	return i;
+}
+
+//Marca o cluster como livre ou ocupado e atualiza o contador. Um cluster livre só
+//entra no mapa de bits em release_freed. Sem o mapa montado, só o contador (lido do
+//superbloco) é mantido.
+void free_map_set(int index, int is_free)
+{
+	if(index < FatDirSize || index >= data_clusters) return;
+
+	if(is_free){
+		free_clusters++;
+		freed[nfreed++] = index;
+	}else{
+		free_clusters--;
+		if(free_map_ready) free_map[index / 64] &= ~(1ULL << (index % 64));
+	}
+}
+
+//Valor da entrada index da FAT, com as marcas da FAT de 16 bits estendidas
+unsigned int fat_get(int index)
+{
+	if(fat_bits == 16){
+		unsigned int value = ((unsigned short *) fat)[index];
+		return value >= FAT16_MAX ? value | 0xFFFF0000u : value;
+	}
+
+	return ((unsigned int *) fat)[index];
+}
+
+//Grava o valor na entrada index da FAT, sem marcar nada como alterado
+void fat_put(int index, unsigned int value)
+{
+	if(fat_bits == 16){
+		((unsigned short *) fat)[index] = value;
+	}else{
+		((unsigned int *) fat)[index] = value;
+	}
+}
+
+//Reconstrói o mapa de bits de clusters livres a partir da FAT.
+//Só entram no mapa os clusters de dados que existem de fato na imagem.
+void build_free_map()
+{
+	memset(free_map, 0, (fat_entries / 64 + 1) * sizeof(unsigned long long));
+	free_clusters = 0;
+	free_hint = 0;
+	free_map_ready = 1;
+
+	for (int i = FatDirSize; i < data_clusters; i++)
+	{
+		if(fat_get(i) == FAT_FREE){
+			free_map[i / 64] |= 1ULL << (i % 64);
+			free_clusters++;
+		}
+	}
+
+	//Os liberados no grupo em memória contam como livres, mas ainda não podem ser usados
+	for (int i = 0; i < nfreed; i++)
+	{
+		free_map[freed[i] / 64] &= ~(1ULL << (freed[i] % 64));
+	}
+}
+
+//Devolve ao mapa de bits os clusters liberados no grupo que acabou de chegar ao journal
+void release_freed()
+{
+	for (int i = 0; i < nfreed; i++)
+	{
+		int index = freed[i];
+		if(free_map_ready && fat_get(index) == FAT_FREE){
+			free_map[index / 64] |= 1ULL << (index % 64);
+			if(index / 64 < free_hint) free_hint = index / 64;
+		}
+	}
+	nfreed = 0;
+}
+
+//Acha o primeiro bloco livre (FAT_FREE na FAT) usando o mapa de bits:
+//palavras sem nenhum bit livre são puladas e o bit é achado com ctz.
+//free_hint guarda a primeira palavra que pode ter um bloco livre.
+int find_first_empty_fat_index()
+{ 
+	if(!free_map_ready) build_free_map();
+
+	int words = (data_clusters + 63) / 64;
+
+	STATS_COUNT(SC_ALLOC_SCANS, 1);
+	for (int w = free_hint; w < words; w++)
+	{
+		if(free_map[w] != 0){
+			STATS_COUNT(SC_ALLOC_WORDS, w - free_hint + 1);
+			free_hint = w;
+			return w * 64 + __builtin_ctzll(free_map[w]);
+		}
+	}
+
+	STATS_COUNT(SC_ALLOC_WORDS, words - free_hint);
+	free_hint = words;
+  	return -1;
+}
+
+int journal_flush();
+
+//Bytes do grupo em memória, com o cabeçalho do bloco
+int journal_bytes()
+{
+	return sizeof(journal_header) + journal_nfat * sizeof(journal_fat) + journal_ndir * sizeof(journal_dir);
+}
+
+//Altera uma entrada da FAT e marca o setor que a contém como sujo.
+//Mantém o mapa de bits de livres coerente com a FAT. Um grupo que já tem
+//2 * journal_group setores vai para o journal antes da alteração, mesmo no meio de
+//uma operação: ele guarda um estado pelo qual a operação passou, em que no máximo
+//ficam clusters ocupados sem uso (cada operação liga clusters só depois de
+//ocupá-los e só os libera depois de desligá-los).
+void fat_set(int index, unsigned int value)
+{
+	unsigned int old = fat_get(index);
+
+	if(old == value) return;
+
+	if(!(journal_fat_mark[index / 64] & (1ULL << (index % 64))) &&
+	   journal_bytes() + sizeof(journal_fat) > 2 * journal_group * SECTORSIZE){
+		journal_flush();
+	}
+
+	if(old == FAT_FREE) free_map_set(index, 0);
+	else if(value == FAT_FREE) free_map_set(index, 1);
+
+	fat_put(index, value);
+	fat_dirty[index / fat_per_sector] = 1;
+
+	if(!(journal_fat_mark[index / 64] & (1ULL << (index % 64))))
+	{
+		journal_fat_mark[index / 64] |= 1ULL << (index % 64);
+		journal_fats[journal_nfat++] = index;
+	}
+}
+
+//Reserva um bloco livre, já marcado como fim de arquivo na FAT
+int alloc_cluster()
+{
+	int index = find_first_empty_fat_index();
+
+	//Sem livres no mapa, os liberados no grupo em memória voltam a ele quando o
+	//grupo vai para o journal
+	if(index == -1 && nfreed > 0 && journal_flush()) index = find_first_empty_fat_index();
+	if(index == -1) return -1;
+
+	fat_set(index, FAT_EOF);
+	STATS_COUNT(SC_ALLOC_CLUSTERS, 1);
+	return index;
+}
+
+int cluster_is_free(int index)
+{
+	if(!free_map_ready) build_free_map();
+
+	if(index < FatDirSize || index >= data_clusters) return 0;
+
+	return (free_map[index / 64] >> (index % 64)) & 1;
+}
+
+//Procura no mapa de bits a primeira sequência de clusters livres com pelo menos want clusters.
+//Se não houver nenhuma, devolve a maior sequência encontrada. O tamanho vai em *len.
+int find_free_run(int want, int *len)
+{
+	if(!free_map_ready) build_free_map();
+
+	int best = -1, best_len = 0;
+	int i = free_hint * 64;
+	long long words = 0;
+
+	STATS_COUNT(SC_ALLOC_SCANS, 1);
+	while(i < data_clusters)
+	{
+		//Pula até o próximo bit livre (palavras sem livres são puladas inteiras)
+		unsigned long long w = free_map[i / 64] >> (i % 64);
+		words++;
+		if(w == 0){
+			i = (i / 64 + 1) * 64;
+			continue;
+		}
+		i += __builtin_ctzll(w);
+		if(i >= data_clusters) break;
+
+		//Estende a sequência até o próximo bit ocupado
+		int start = i;
+		while(i < data_clusters)
+		{
+			unsigned long long used = ~free_map[i / 64] >> (i % 64);
+			words++;
+			if(used == 0){
+				i = (i / 64 + 1) * 64;
+				continue;
+			}
+			i += __builtin_ctzll(used);
+			break;
+		}
+		if(i > data_clusters) i = data_clusters;
+
+		if(i - start >= want){
+			STATS_COUNT(SC_ALLOC_WORDS, words);
+			*len = want;
+			return start;
+		}
+		if(i - start > best_len){
+			best = start;
+			best_len = i - start;
+		}
+	}
+
+	STATS_COUNT(SC_ALLOC_WORDS, words);
+	*len = best_len;
+	return best;
+}
+
+//Reserva uma sequência contígua de até want clusters para continuar um arquivo cujo
+//último cluster é prev. A preferência é continuar logo depois de prev; depois, uma
+//sequência livre do tamanho pedido; por fim, com o espaço fragmentado, a maior sequência
+//disponível. A reserva fica só em memória: os clusters saem do mapa de bits e do
+//contador de livres, mas continuam livres na FAT (e no journal) até que claim_cluster
+//os ligue a alguma coisa, então uma queda não deixa clusters reservados perdidos. Os
+//não usados voltam com unreserve_cluster. O tamanho da reserva vai em *len.
+int reserve_extent(int prev, int want, int *len)
+{
+	int next_len = 0;
+	while(next_len < want && cluster_is_free(prev + 1 + next_len)) next_len++;
+
+	int start = prev + 1;
+	*len = next_len;
+
+	if(next_len < want){
+		int run_len;
+		int run = find_free_run(want, &run_len);
+
+		//Como em alloc_cluster, os liberados no grupo em memória só podem ser usados
+		//depois que ele for para o journal
+		if(run_len == 0 && next_len == 0 && nfreed > 0 && journal_flush()){
+			run = find_free_run(want, &run_len);
+		}
+		if(run_len == want || (run_len > 0 && next_len == 0)){
+			start = run;
+			*len = run_len;
+		}
+	}
+
+	if(*len == 0) return -1;
+
+	for (int i = 0; i < *len; i++)
+	{
+		free_map_set(start + i, 0);
+	}
+	STATS_COUNT(SC_ALLOC_CLUSTERS, *len);
+
+	return start;
+}
+
+//Grava value na entrada da FAT de um cluster reservado por reserve_extent, que o
+//contador e o mapa de bits já contam como ocupado
+void claim_cluster(int index, unsigned int value)
+{
+	free_clusters++;
+	fat_set(index, value);
+}
+
+//Devolve ao mapa de bits um cluster reservado e não usado. Ele nunca saiu da FAT como
+//livre, então pode ser usado de novo sem esperar pelo journal.
+void unreserve_cluster(int index)
+{
+	free_clusters++;
+	if(free_map_ready){
+		free_map[index / 64] |= 1ULL << (index % 64);
+		if(index / 64 < free_hint) free_hint = index / 64;
+	}
+}
+
+//Como reserve_extent, mas os clusters saem da reserva já marcados como fim de arquivo
+//na FAT, para o chamador fazer o encadeamento
+int alloc_extent(int prev, int want, int *len)
+{
+	int start = reserve_extent(prev, want, len);
+
+	for (int i = 0; start != -1 && i < *len; i++)
+	{
+		claim_cluster(start + i, FAT_EOF);
+	}
+
+	return start;
+}
+
+//Posição de cluster na tabela de compartilhados, ou a posição vazia onde ele entraria
+int share_slot(int cluster)
+{
+	int i = (cluster * 2654435761u) & (share_cap - 1);
+
+	while(share_key[i] != -1 && share_key[i] != cluster) i = (i + 1) & (share_cap - 1);
+	return i;
+}
+
+//Referências ao cluster: 1 para os que não estão na tabela
+int share_refs(int cluster)
+{
+	if(share_cap == 0) return 1;
+
+	int i = share_slot(cluster);
+	return share_key[i] == -1 ? 1 : share_refs_of[i];
+}
+
+//Primeiro cluster lógico da cadeia que começa em first_block compartilhado com outra
+//cópia, ou -1. Usa a tabela de compartilhados, que precisa estar montada.
+int first_shared(unsigned int first_block)
+{
+	int lcn = 0;
+
+	for (unsigned int c = first_block; c < (unsigned int) fat_entries && lcn <= data_clusters; c = fat_get(c), lcn++)
+	{
+		if(share_refs(c) > 1) return lcn;
+	}
+
+	return -1;
+}
+
+//Dobra a tabela de compartilhados, reinserindo as entradas
+int share_grow()
+{
+	int old_cap = share_cap;
+	int *old_key = share_key;
+	int *old_refs = share_refs_of;
+	int cap = share_cap ? 2 * share_cap : 256;
+
+	share_key = malloc(cap * sizeof(int));
+	share_refs_of = malloc(cap * sizeof(int));
+	if(share_key == NULL || share_refs_of == NULL){
+		printf("Erro: Memória insuficiente para a tabela de clusters compartilhados\n");
+		free(share_key);
+		free(share_refs_of);
+		share_key = old_key;
+		share_refs_of = old_refs;
+		return 0;
+	}
+	memset(share_key, -1, cap * sizeof(int));
+	share_cap = cap;
+
+	for (int i = 0; i < old_cap; i++)
+	{
+		if(old_key[i] != -1){
+			int j = share_slot(old_key[i]);
+			share_key[j] = old_key[i];
+			share_refs_of[j] = old_refs[i];
+		}
+	}
+	free(old_key);
+	free(old_refs);
+
+	return 1;
+}
+
+//Soma delta às referências do cluster. Um cluster que volta a ter uma só referência
+//sai da tabela (as entradas seguintes do mesmo grupo são puxadas para trás).
+//Devolve as referências que sobraram ou -1 se faltar memória.
+int share_add(int cluster, int delta)
+{
+	if(2 * (share_len + 1) > share_cap && !share_grow() && share_len + 1 >= share_cap) return -1;
+
+	int i = share_slot(cluster);
+	int refs = (share_key[i] == -1 ? 1 : share_refs_of[i]) + delta;
+
+	if(refs > 1){
+		if(share_key[i] == -1){
+			share_key[i] = cluster;
+			__atomic_store_n(&share_len, share_len + 1, __ATOMIC_RELAXED);
+		}
+		share_refs_of[i] = refs;
+	}else if(share_key[i] != -1){
+		int mask = share_cap - 1;
+		for (int j = (i + 1) & mask; share_key[j] != -1; j = (j + 1) & mask)
+		{
+			int home = (share_key[j] * 2654435761u) & mask;
+			if(((j - home) & mask) >= ((j - i) & mask)){
+				share_key[i] = share_key[j];
+				share_refs_of[i] = share_refs_of[j];
+				i = j;
+			}
+		}
+		share_key[i] = -1;
+		__atomic_store_n(&share_len, share_len - 1, __ATOMIC_RELAXED);
+	}
+
+	return refs;
+}
+
+int read_dmap(int slot, dmap_entry **out);
+
+//Marca uma referência a target em seen; a partir da segunda, ela vai para a tabela
+int share_seen(unsigned long long *seen, unsigned int target)
+{
+	if(target < (unsigned int) FatDirSize || target >= (unsigned int) data_clusters) return 1;
+
+	if(seen[target / 64] & (1ULL << (target % 64))) return share_add(target, 1) != -1;
+	seen[target / 64] |= 1ULL << (target % 64);
+	return 1;
+}
+
+//Conta as referências a cada cluster (entradas usadas do diretório, pelo primeiro
+//cluster e pelo índice de grupos, entradas da FAT que apontam para ele e registros
+//dos mapas das cópias com mapa de clusters) e guarda na tabela as dos que têm mais
+//de uma. Como o mapa de livres, só é montado quando é preciso.
+int build_share_map()
+{
+	unsigned long long *seen = calloc(fat_entries / 64 + 1, sizeof(unsigned long long));
+	if(seen == NULL){
+		printf("Erro: Memória insuficiente para a tabela de clusters compartilhados\n");
+		return 0;
+	}
+
+	if(share_cap > 0) memset(share_key, -1, share_cap * sizeof(int));
+	__atomic_store_n(&share_len, 0, __ATOMIC_RELAXED);
+	share_ready = 1;
+
+	for (int i = 0; i < 2 * dir_entries + data_clusters; i++)
+	{
+		unsigned int target;
+		if(i < 2 * dir_entries){
+			int slot = i % dir_entries;
+			if(!ENTRY(slot).used) continue;
+			target = i < dir_entries ? ENTRY(slot).first_block : ENTRY(slot).index_block;
+		}else{
+			if(i - 2 * dir_entries < FatDirSize) continue;
+			target = fat_get(i - 2 * dir_entries);
+		}
+		if(!share_seen(seen, target)){
+			free(seen);
+			return 0;
+		}
+	}
+
+	//Um mapa compartilhado por várias cópias conta uma vez para cada uma
+	for (int i = 0; i < dir_entries; i++)
+	{
+		dmap_entry *dmap;
+		int n;
+
+		if(!ENTRY(i).used || !(ENTRY(i).flags & DIR_CLUSTERMAP) || (n = read_dmap(i, &dmap)) == -1) continue;
+		for (int k = 0; k < n; k++)
+		{
+			if(!share_seen(seen, dmap[k].cluster)){
+				free(dmap);
+				free(seen);
+				return 0;
+			}
+		}
+		free(dmap);
+	}
+	free(seen);
+
+	return 1;
+}
+
+//Hash do conteúdo de um cluster, lido 8 bytes por vez, para a deduplicação
+unsigned int cluster_hash(char *data)
+{
+	unsigned long long h = 0x9E3779B97F4A7C15ULL;
+
+	for (int i = 0; i < cluster_size; i += 8)
+	{
+		unsigned long long w;
+		memcpy(&w, &data[i], 8);
+		w *= 0x87C37B91114253D5ULL;
+		w ^= w >> 31;
+		h = (h ^ w) * 0x4CF5AD432745937FULL;
+	}
+	h ^= h >> 33;
+
+	return (unsigned int) h;
+}
+
+//Posição de (hash, cluster) no índice de conteúdo, ou a posição vazia onde ele entraria
+int dedup_slot(unsigned int hash, int cluster)
+{
+	int mask = dedup_cap - 1;
+	int i = hash & mask;
+
+	while(dedup_table[i].cluster != -1 && (dedup_table[i].hash != hash || dedup_table[i].cluster != cluster)) i = (i + 1) & mask;
+	return i;
+}
+
+//Referências ao cluster de conteúdo hash (0 para os que não estão no índice)
+int dedup_refs(unsigned int hash, int cluster)
+{
+	if(dedup_cap == 0) return 0;
+
+	int i = dedup_slot(hash, cluster);
+	return dedup_table[i].cluster == -1 ? 0 : dedup_table[i].refs;
+}
+
+//Dobra o índice de conteúdo, reinserindo as entradas
+int dedup_grow()
+{
+	int old_cap = dedup_cap;
+	dedup_entry *old = dedup_table;
+	int cap = dedup_cap ? 2 * dedup_cap : 1024;
+
+	dedup_table = malloc(cap * sizeof(dedup_entry));
+	if(dedup_table == NULL){
+		printf("Erro: Memória insuficiente para o índice de conteúdo\n");
+		dedup_table = old;
+		return 0;
+	}
+	for (int i = 0; i < cap; i++) dedup_table[i].cluster = -1;
+	dedup_cap = cap;
+
+	for (int i = 0; i < old_cap; i++)
+	{
+		if(old[i].cluster != -1) dedup_table[dedup_slot(old[i].hash, old[i].cluster)] = old[i];
+	}
+	free(old);
+
+	return 1;
+}
+
+//Esvazia o índice de conteúdo
+void dedup_clear()
+{
+	for (int i = 0; i < dedup_cap; i++) dedup_table[i].cluster = -1;
+	dedup_len = 0;
+	dedup_total = 0;
+}
+
+//Soma delta às referências do cluster com conteúdo hash, que entra no índice se não
+//estiver nele. Um cluster sem referências sai do índice (as entradas seguintes do
+//mesmo grupo são puxadas para trás). Devolve as referências que sobraram ou -1 se
+//faltar memória.
+int dedup_ref(unsigned int hash, int cluster, int delta)
+{
+	if(2 * (dedup_len + 1) > dedup_cap && !dedup_grow() && dedup_len + 1 >= dedup_cap) return -1;
+
+	int i = dedup_slot(hash, cluster);
+	int refs = (dedup_table[i].cluster == -1 ? 0 : dedup_table[i].refs) + delta;
+
+	dedup_total += delta;
+	dedup_dirty = 1;
+
+	if(refs > 0){
+		if(dedup_table[i].cluster == -1){
+			dedup_table[i].hash = hash;
+			dedup_table[i].cluster = cluster;
+			dedup_len++;
+		}
+		dedup_table[i].refs = refs;
+	}else if(dedup_table[i].cluster != -1){
+		int mask = dedup_cap - 1;
+		for (int j = (i + 1) & mask; dedup_table[j].cluster != -1; j = (j + 1) & mask)
+		{
+			int home = dedup_table[j].hash & mask;
+			if(((j - home) & mask) >= ((j - i) & mask)){
+				dedup_table[i] = dedup_table[j];
+				i = j;
+			}
+		}
+		dedup_table[i].cluster = -1;
+		dedup_len--;
+	}
+
+	return refs;
+}
+
+//Conta em quantos trechos contíguos (extents) a cadeia de um arquivo está dividida.
+//O total de clusters da cadeia vai em *clusters. Lida sem trava (fs_list), a cadeia
+//pode estar pela metade: o percurso nunca sai da FAT nem passa do total de clusters.
+int count_extents(int first_block, int *clusters)
+{
+	int extents = 1;
+
+	//Valores a partir de fat_entries são marcas, não clusters
+	*clusters = 1;
+	if((unsigned int) first_block >= (unsigned int) fat_entries) return extents;
+	for (unsigned int pos = first_block; fat_get(pos) < (unsigned int) fat_entries && *clusters <= data_clusters; pos = fat_get(pos))
+	{
+		if(fat_get(pos) != pos + 1) extents++;
+		(*clusters)++;
+	}
+
+	return extents;
+}
+
+//Libera a cadeia que começa no cluster pos, até a marca de fim de arquivo ou até o
+//primeiro cluster compartilhado, que fica (com o resto da cadeia) com a outra cópia
+void free_chain(unsigned int pos)
+{
+	if(!share_ready) build_share_map();
+
+	while(pos < (unsigned int) fat_entries){
+		unsigned int nextPos = fat_get(pos);
+
+		if(share_refs(pos) > 1){
+			share_add(pos, -1);
+			break;
+		}
+
+		fat_set(pos, FAT_FREE);
+		pos = nextPos;
+	}
+}
+
+//Clusters que a liberação da cadeia que começa em pos devolveria (ver free_chain)
+long long chain_private(unsigned int pos)
+{
+	long long n = 0;
+
+	for (; pos < (unsigned int) fat_entries && n < data_clusters && share_refs(pos) == 1; pos = fat_get(pos)) n++;
+
+	return n;
+}
+
+//Marca todos os setores de metadados como sujos (usado na formatação)
+void mark_all_dirty()
+{
+	memset(fat_dirty, 1, fat_sectors);
+	memset(dir_dirty, 1, dir_nsectors);
+}
+
+//Marca como sujo o setor do diretório que contém a entrada slot
+void mark_dir_dirty(int slot)
+{
+	dir_dirty[slot / dir_per_cluster] = 1;
+
+	if(!journal_dir_mark[slot])
+	{
+		journal_dir_mark[slot] = 1;
+		journal_dirs[journal_ndir++] = slot;
+	}
+}
+
+//Transfere count setores consecutivos entre o disco e um buffer contíguo,
+//usando uma chamada vetorizada a cada IOVBATCH setores
+int xfer_sectors(int write, int sector, int count, char *buffer)
+{
+	struct iovec iov[IOVBATCH];
+
+	while(count > 0){
+		int batch = count < IOVBATCH ? count : IOVBATCH;
+
+		for (int i = 0; i < batch; i++) {
+			iov[i].iov_base = &buffer[i*SECTORSIZE];
+			iov[i].iov_len = SECTORSIZE;
+		}
+
+		if(write ? !bl_writev(sector, batch, iov) : !bl_readv(sector, batch, iov)){
+			return 0;
+		}
+
+		sector += batch;
+		buffer += batch*SECTORSIZE;
+		count -= batch;
+	}
+
+	return 1;
+}
+
+int write_sectors(int sector, int count, char *buffer)
+{
+	return xfer_sectors(1, sector, count, buffer);
+}
+
+int read_sectors(int sector, int count, char *buffer)
+{
+	return xfer_sectors(0, sector, count, buffer);
+}
+
+//Transferem count clusters consecutivos a partir de cluster
+int write_clusters(int cluster, int count, char *buffer)
+{
+	return write_sectors(cluster * cluster_sectors, count * cluster_sectors, buffer);
+}
+
+int read_clusters(int cluster, int count, char *buffer)
+{
+	return read_sectors(cluster * cluster_sectors, count * cluster_sectors, buffer);
+}
+
+//Escreve no disco apenas os setores da FAT que foram alterados.
+//Setores sujos consecutivos são escritos juntos.
+int write_fat(){
+	int i = 0;
+
+	while (i < fat_sectors) {
+		if(!fat_dirty[i]){
+			i++;
+			continue;
+		}
+
+		int start = i;
+		while(i < fat_sectors && fat_dirty[i]){
+			fat_dirty[i] = 0;
+			i++;
+		}
+
+		//A FAT começa no cluster 1
+		STATS_COUNT(SC_FAT_SECTORS, i - start);
+		if(!write_sectors(cluster_sectors + start, i - start, &fat[start*SECTORSIZE])){
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+//Escreve os setores do diretório que foram alterados. Setores sujos em
+//clusters consecutivos são escritos juntos, com um vetor por setor do disco.
+int write_dir(){
+	struct iovec iov[IOVBATCH];
+	int i = 0;
+
+	while (i < dir_nsectors) {
+		if(!dir_dirty[i]){
+			i++;
+			continue;
+		}
+
+		int start = i;
+		int count = 0;
+		while(i < dir_nsectors && dir_dirty[i] && count + cluster_sectors <= IOVBATCH &&
+		      dir_clusters[i] == dir_clusters[start] + i - start){
+			for (int j = 0; j < cluster_sectors; j++) {
+				iov[count].iov_base = (char *) dir_sectors[i] + j*SECTORSIZE;
+				iov[count].iov_len = SECTORSIZE;
+				count++;
+			}
+			dir_dirty[i] = 0;
+			i++;
+		}
+
+		STATS_COUNT(SC_DIR_SECTORS, count);
+		if(!bl_writev(dir_clusters[start] * cluster_sectors, count, iov)){
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+//Grava o superbloco com a geometria atual e o estado clean
+int write_superblock(int clean)
+{
+	char sector[SECTORSIZE];
+	superblock *sb = (superblock *) sector;
+
+	memset(sector, 0, SECTORSIZE);
+	sb->magic = SUPERMAGIC;
+	sb->version = SUPERVERSION;
+	sb->sector_size = SECTORSIZE;
+	sb->sectors = bl_size();
+	sb->fat_bits = fat_bits;
+	sb->cluster_sectors = cluster_sectors;
+	sb->fat_sectors = fat_sectors;
+	sb->fat_entries = fat_entries;
+	sb->dir_start = dir_start;
+	sb->journal_start = journal_start;
+	sb->journal_sectors = journal_sectors;
+	sb->journal_seq = journal_seq;
+	sb->free_clusters = free_clusters;
+	sb->shared_clusters = share_len;
+	sb->dedup_block = dedup_block;
+	sb->clean = clean;
+	sb->checksum = checksum((char *) sb, sizeof(superblock));
+
+	sb_clean = clean;
+	STATS_COUNT(SC_SUPERBLOCKS, 1);
+	return bl_write(SUPERBLOCK, sector);
+}
+
+//Lê o superbloco e confere assinatura, versão, checksum e os parâmetros da
+//geometria. O resto da geometria e o tamanho da imagem são conferidos por quem chama.
+int read_superblock(superblock *sb)
+{
+	char sector[SECTORSIZE];
+
+	if(!bl_read(SUPERBLOCK, sector)) return 0;
+	memcpy(sb, sector, sizeof(superblock));
+
+	unsigned int sum = sb->checksum;
+	sb->checksum = 0;
+	if(checksum((char *) sb, sizeof(superblock)) != sum) return 0;
+	sb->checksum = sum;
+
+	return sb->magic == SUPERMAGIC && sb->version == SUPERVERSION &&
+	       sb->sector_size == SECTORSIZE && (sb->fat_bits == 16 || sb->fat_bits == 32) &&
+	       sb->cluster_sectors >= 1 && sb->cluster_sectors * SECTORSIZE <= MAX_CLUSTER_SIZE &&
+	       (sb->cluster_sectors & (sb->cluster_sectors - 1)) == 0 && sb->fat_entries > 0 &&
+	       sb->fat_entries <= (sb->fat_bits == 16 ? FAT16_MAX : FAT32_MAX);
+}
+
+//Antes da primeira alteração nos metadados do disco, o superbloco deixa de dizer
+//que a imagem está limpa
+int mark_in_use()
+{
+	return !sb_clean || write_superblock(0);
+}
+
+//Lê os primeiros bytes de uma cadeia de metadados de um arquivo (o índice de grupos
+//ou o mapa de clusters). Devolve 0 se a cadeia for menor que isso ou inválida.
+int read_meta_chain(unsigned int c, char *out, int bytes)
+{
+	char *buffer = malloc(cluster_size);
+	if(buffer == NULL)
+	{
+		printf("Erro: Memória insuficiente para ler o arquivo\n");
+		return 0;
+	}
+
+	for (int done = 0; done < bytes; done += cluster_size)
+	{
+		int n = bytes - done < cluster_size ? bytes - done : cluster_size;
+
+		if(c < (unsigned int) FatDirSize || c >= (unsigned int) data_clusters ||
+		   !read_clusters(c, 1, n == cluster_size ? &out[done] : buffer))
+		{
+			free(buffer);
+			return 0;
+		}
+		if(n < cluster_size) memcpy(&out[done], buffer, n);
+		c = fat_get(c);
+	}
+	free(buffer);
+
+	return 1;
+}
+
+//Lê o mapa de um arquivo com deduplicação ou de uma cópia com mapa de clusters,
+//guardado na sua cadeia: um registro por cluster do tamanho atual do arquivo. Os
+//clusters de uma cópia podem ter qualquer valor na FAT, menos livre ou uma marca.
+//Devolve o número de registros ou -1.
+int read_dmap(int slot, dmap_entry **out)
+{
+	int dedup = (ENTRY(slot).flags & DIR_DEDUP) != 0;
+	int n = (ENTRY(slot).size + cluster_size - 1) / cluster_size;
+	dmap_entry *dmap = malloc((n + 1) * sizeof(dmap_entry));
+
+	if(dmap == NULL)
+	{
+		printf("Erro: Memória insuficiente para o mapa do arquivo\n");
+		return -1;
+	}
+
+	int ok = read_meta_chain(ENTRY(slot).first_block, (char *) dmap, n * sizeof(dmap_entry));
+	for (int i = 0; ok && i < n; i++)
+	{
+		unsigned int v = dmap[i].cluster >= FatDirSize && dmap[i].cluster < data_clusters ? fat_get(dmap[i].cluster) : FAT_FREE;
+		ok = dedup ? v == DEDUPDATA : v == FAT_EOF || (v != FAT_FREE && v < (unsigned int) data_clusters);
+	}
+	if(!ok)
+	{
+		free(dmap);
+		printf("Erro: Mapa do arquivo %s está corrompido\n", ENTRY(slot).name);
+		return -1;
+	}
+
+	*out = dmap;
+	return n;
+}
+
+//Conta em quantos trechos contíguos estão os clusters de dados de um arquivo com
+//deduplicação de size bytes, na ordem do mapa que começa em first_block (a cadeia na
+//FAT guarda só o mapa). Devolve -1 se o mapa não puder ser lido.
+int count_dedup_extents(unsigned int first_block, long long size)
+{
+	int n = (size + cluster_size - 1) / cluster_size;
+	dmap_entry *dmap = malloc((n + 1) * sizeof(dmap_entry));
+	int extents = -1;
+
+	if(dmap != NULL && read_meta_chain(first_block, (char *) dmap, n * sizeof(dmap_entry)))
+	{
+		extents = 0;
+		for (int i = 0; i < n; i++)
+		{
+			if(i == 0 || dmap[i].cluster != dmap[i - 1].cluster + 1) extents++;
+		}
+	}
+	free(dmap);
+
+	return extents;
+}
+
+//Soma delta às referências de todos os clusters do mapa do arquivo slot. Com delta
+//negativo, os clusters que ficam sem referências são liberados; com seen, os clusters
+//são marcados no mapa de bits.
+int dedup_walk(int slot, int delta, unsigned long long *seen)
+{
+	dmap_entry *dmap;
+	int n = read_dmap(slot, &dmap);
+
+	if(n == -1) return 0;
+
+	for (int i = 0; i < n; i++)
+	{
+		int refs = dedup_ref(dmap[i].hash, dmap[i].cluster, delta);
+		if(refs == -1)
+		{
+			free(dmap);
+			return 0;
+		}
+		if(refs == 0 && delta < 0) fat_set(dmap[i].cluster, FAT_FREE);
+		if(seen != NULL) seen[dmap[i].cluster / 64] |= 1ULL << (dmap[i].cluster % 64);
+	}
+	free(dmap);
+
+	return 1;
+}
+
+//Soma delta (1 ou -1) às referências de todos os clusters do mapa da cópia slot. Com
+//-1, os clusters que ficam sem referências são liberados, com o resto da cadeia da FAT
+//que só eles usavam (ver free_chain).
+int clustermap_walk(int slot, int delta)
+{
+	dmap_entry *dmap;
+	int n = read_dmap(slot, &dmap);
+
+	if(n == -1) return 0;
+
+	for (int i = 0; i < n; i++)
+	{
+		if(delta < 0){
+			free_chain(dmap[i].cluster);
+		}else if(share_add(dmap[i].cluster, delta) == -1){
+			while(--i >= 0) share_add(dmap[i].cluster, -delta);
+			free(dmap);
+			return 0;
+		}
+	}
+	free(dmap);
+
+	return 1;
+}
+
+//Refaz o índice de conteúdo a partir dos mapas dos arquivos com deduplicação (depois
+//de uma queda, o índice gravado no disco pode estar desatualizado). Os clusters de
+//dados que ficaram sem referências e os do índice antigo são liberados.
+int dedup_rebuild()
+{
+	unsigned long long *seen = calloc(fat_entries / 64 + 1, sizeof(unsigned long long));
+	if(seen == NULL){
+		printf("Erro: Memória insuficiente para o índice de conteúdo\n");
+		return 0;
+	}
+
+	dedup_clear();
+	dedup_ready = 1;
+
+	for (int i = 0; i < dir_entries; i++)
+	{
+		if(ENTRY(i).used && (ENTRY(i).flags & DIR_DEDUP)) dedup_walk(i, 1, seen);
+	}
+
+	for (int c = FatDirSize; c < data_clusters; c++)
+	{
+		unsigned int v = fat_get(c);
+		if(v == DEDUPINDEX || (v == DEDUPDATA && !(seen[c / 64] & (1ULL << (c % 64))))) fat_set(c, FAT_FREE);
+	}
+	free(seen);
+
+	dedup_block = 0;
+	dedup_dirty = dedup_len > 0;
+	return 1;
+}
+
+//Lê o índice de conteúdo gravado no último desligamento. Um índice inválido é refeito
+//a partir dos mapas dos arquivos.
+int dedup_load()
+{
+	int per = (cluster_size - sizeof(dedup_header)) / sizeof(dedup_entry);
+	char *buffer = malloc(cluster_size);
+	if(buffer == NULL){
+		printf("Erro: Memória insuficiente para o índice de conteúdo\n");
+		return 0;
+	}
+
+	dedup_clear();
+	dedup_ready = 1;
+
+	int ok = 1;
+	unsigned int c = dedup_block;
+	for (int k = 0; ok && c != 0; k++)
+	{
+		dedup_header *h = (dedup_header *) buffer;
+		dedup_entry *e = (dedup_entry *) (h + 1);
+
+		ok = k < data_clusters && c >= (unsigned int) FatDirSize && c < (unsigned int) data_clusters &&
+		     fat_get(c) == DEDUPINDEX && read_clusters(c, 1, buffer) && h->count >= 0 && h->count <= per;
+		for (int i = 0; ok && i < h->count; i++)
+		{
+			ok = e[i].cluster >= FatDirSize && e[i].cluster < data_clusters && e[i].refs > 0 &&
+			     dedup_ref(e[i].hash, e[i].cluster, e[i].refs) != -1;
+		}
+		c = h->next;
+	}
+	free(buffer);
+
+	if(!ok)
+	{
+		printf("Erro: Índice de conteúdo está corrompido; ele será refeito\n");
+		return dedup_rebuild();
+	}
+	dedup_dirty = 0;
+
+	return 1;
+}
+
+//Garante que o índice de conteúdo está em memória
+int dedup_prepare()
+{
+	return dedup_ready || dedup_load();
+}
+
+//Grava o índice de conteúdo em clusters novos (no desligamento) e libera os do
+//índice anterior
+int dedup_save()
+{
+	if(!dedup_ready || !dedup_dirty) return 1;
+
+	int per = (cluster_size - sizeof(dedup_header)) / sizeof(dedup_entry);
+	int count = (dedup_len + per - 1) / per;
+	char *buffer = malloc(cluster_size);
+	int *clusters = malloc((count + 1) * sizeof(int));
+	if(buffer == NULL || clusters == NULL){
+		free(buffer);
+		free(clusters);
+		printf("Erro: Memória insuficiente para o índice de conteúdo\n");
+		return 0;
+	}
+	dedup_header *h = (dedup_header *) buffer;
+	dedup_entry *e = (dedup_entry *) (h + 1);
+
+	for (unsigned int c = dedup_block; c != 0; )
+	{
+		if(c < (unsigned int) FatDirSize || c >= (unsigned int) data_clusters ||
+		   fat_get(c) != DEDUPINDEX || !read_clusters(c, 1, buffer)) break;
+		unsigned int next = h->next;
+		fat_set(c, FAT_FREE);
+		c = next;
+	}
+	dedup_block = 0;
+
+	int ok = 1;
+	for (int k = 0; ok && k < count; k++)
+	{
+		int len;
+		clusters[k] = alloc_extent(k > 0 ? clusters[k - 1] : FatDirSize - 1, 1, &len);
+		if(clusters[k] == -1){
+			printf("Erro: Não há espaço para o índice de conteúdo\n");
+			while(--k >= 0) fat_set(clusters[k], FAT_FREE);
+			ok = 0;
+		}else{
+			fat_set(clusters[k], DEDUPINDEX);
+		}
+	}
+
+	for (int k = 0, i = 0; ok && k < count; k++)
+	{
+		memset(buffer, 0, cluster_size);
+		h->next = k + 1 < count ? clusters[k + 1] : 0;
+		for (h->count = 0; h->count < per && i < dedup_cap; i++)
+		{
+			if(dedup_table[i].cluster != -1) e[h->count++] = dedup_table[i];
+		}
+		ok = write_clusters(clusters[k], 1, buffer);
+	}
+
+	if(ok){
+		dedup_block = count > 0 ? clusters[0] : 0;
+		dedup_dirty = 0;
+	}
+	free(buffer);
+	free(clusters);
+
+	return ok;
+}
+
+//Começa uma nova geração do journal, vazia. Os blocos da geração anterior
+//deixam de valer.
+int journal_reset()
+{
+	char sector[SECTORSIZE];
+	journal_header *h = (journal_header *) sector;
+
+	memset(sector, 0, SECTORSIZE);
+	h->magic = JOURNALMAGIC;
+	h->seq = ++journal_seq;
+	journal_pos = 1;
+
+	return bl_write(journal_start, sector);
+}
+
+//Esquece as alterações do grupo em memória (já gravadas de outra forma)
+void journal_clear()
+{
+	for (int i = 0; i < journal_nfat; i++) {
+		journal_fat_mark[journal_fats[i] / 64] &= ~(1ULL << (journal_fats[i] % 64));
+	}
+	for (int i = 0; i < journal_ndir; i++) {
+		journal_dir_mark[journal_dirs[i]] = 0;
+	}
+	journal_nfat = 0;
+	journal_ndir = 0;
+}
+
+//Grava nos setores de origem a FAT e o diretório que estão no journal
+//e recomeça o journal
+int checkpoint()
+{
+	STATS_COUNT(SC_CHECKPOINTS, 1);
+	return mark_in_use() && write_fat() && write_dir() && bl_sync() && journal_reset();
+}
+
+//Grava o grupo de alterações em memória como um único bloco no journal, numa
+//escrita sequencial, e espera que ele chegue ao disco. Quando os blocos passam de
+//journal_limit setores, é feito o checkpoint.
+int journal_flush()
+{
+	if(journal_nfat == 0 && journal_ndir == 0) return 1;
+
+	int bytes = journal_bytes();
+	int sectors = (bytes + SECTORSIZE - 1) / SECTORSIZE;
+
+	//O checkpoint deixa sempre espaço para journal_group_max setores; um grupo maior
+	//não pode ir para o journal nem, sem ele, para os setores de origem
+	if(journal_pos + sectors > journal_sectors){
+		printf("Erro: Grupo de alterações maior que o journal\n");
+		return 0;
+	}
+
+	char *block = calloc(sectors, SECTORSIZE);
+	if(block == NULL){
+		printf("Erro: Memória insuficiente para o journal\n");
+		return 0;
+	}
+
+	journal_header *h = (journal_header *) block;
+	journal_fat *fats = (journal_fat *) (h + 1);
+	journal_dir *dirs = (journal_dir *) (fats + journal_nfat);
+
+	h->magic = JOURNALMAGIC;
+	h->seq = journal_seq;
+	h->sectors = sectors;
+	h->nfat = journal_nfat;
+	h->ndir = journal_ndir;
+	for (int i = 0; i < journal_nfat; i++) {
+		fats[i].index = journal_fats[i];
+		fats[i].value = fat_get(journal_fats[i]);
+	}
+	for (int i = 0; i < journal_ndir; i++) {
+		dirs[i].slot = journal_dirs[i];
+		dirs[i].entry = ENTRY(journal_dirs[i]);
+	}
+	h->checksum = checksum(block, sectors * SECTORSIZE);
+	journal_clear();
+	STATS_COUNT(SC_JOURNAL_BLOCKS, 1);
+	STATS_COUNT(SC_JOURNAL_SECTORS, sectors);
+
+	int ok = mark_in_use() && write_sectors(journal_start + journal_pos, sectors, block) && bl_sync();
+	free(block);
+	journal_pos += sectors;
+	if(ok) release_freed();
+
+	if(ok && journal_pos > journal_limit){
+		ok = checkpoint();
+	}
+
+	return ok;
+}
+
+//Fim de uma operação sobre a FAT e o diretório. Suas alterações se juntam ao grupo
+//em memória, que vai para o journal quando completa journal_group setores (ou em fs_sync).
+int journal_commit()
+{
+	if(journal_bytes() >= journal_group * SECTORSIZE){
+		return journal_flush();
+	}
+
+	return 1;
+}
+
+//Refaz na FAT e no diretório em memória as alterações dos blocos válidos do journal,
+//carregando o diretório no meio do caminho (a cadeia dele pode ter mudado). Com
+//algo refeito, é feito o checkpoint. Devolve 0 se o journal ou o diretório forem inválidos.
+int replay_journal()
+{
+	char *log = malloc((size_t) journal_sectors * SECTORSIZE);
+	if(log == NULL){
+		printf("Erro: Memória insuficiente para o journal\n");
+		return 0;
+	}
+
+	journal_header *gen = (journal_header *) log;
+	if(!read_sectors(journal_start, journal_sectors, log) || gen->magic != JOURNALMAGIC){
+		free(log);
+		return 0;
+	}
+	journal_seq = gen->seq;
+
+	//Primeira passada: FAT. Para no primeiro bloco incompleto ou de outra geração.
+	int end = 1;
+	while(end < journal_sectors)
+	{
+		journal_header *h = (journal_header *) &log[end * SECTORSIZE];
+		if(h->magic != JOURNALMAGIC || h->seq != journal_seq || h->sectors < 1 || end + h->sectors > journal_sectors ||
+		   h->nfat < 0 || h->ndir < 0 ||
+		   sizeof(journal_header) + h->nfat * sizeof(journal_fat) + h->ndir * sizeof(journal_dir) > (size_t) h->sectors * SECTORSIZE) break;
+
+		unsigned int sum = h->checksum;
+		h->checksum = 0;
+		if(checksum((char *) h, h->sectors * SECTORSIZE) != sum) break;
+
+		journal_fat *fats = (journal_fat *) (h + 1);
+		for (int i = 0; i < h->nfat; i++) {
+			if(fats[i].index < (unsigned int) fat_entries){
+				fat_put(fats[i].index, fats[i].value);
+				fat_dirty[fats[i].index / fat_per_sector] = 1;
+			}
+		}
+		end += h->sectors;
+	}
+
+	//Segunda passada: diretório, já com a cadeia refeita
+	int ok = load_dir();
+	for (int pos = 1; ok && pos < end; pos += ((journal_header *) &log[pos * SECTORSIZE])->sectors)
+	{
+		journal_header *h = (journal_header *) &log[pos * SECTORSIZE];
+		journal_dir *dirs = (journal_dir *) ((journal_fat *) (h + 1) + h->nfat);
+		for (int i = 0; i < h->ndir; i++) {
+			if(dirs[i].slot >= 0 && dirs[i].slot < dir_entries){
+				ENTRY(dirs[i].slot) = dirs[i].entry;
+				dir_dirty[dirs[i].slot / dir_per_cluster] = 1;
+			}
+		}
+	}
+	free(log);
+
+	journal_pos = 1;
+	if(ok && end > 1){
+		ok = checkpoint();
+	}
+
+	return ok;
+}
+
+//Descarta o diretório em memória, e o que foi guardado para os leitores sem trava
+void release_dir()
+{
+	for (int i = 0; i < dir_nsectors; i++)
+	{
+		free(dir_sectors[i]);
+	}
+	dir_nsectors = 0;
+	dir_entries = 0;
+
+	for (int i = 0; i < nretired; i++)
+	{
+		free(retired[i]);
+	}
+	nretired = 0;
+}
+
+//Acrescenta ao diretório em memória o setor guardado em cluster, lendo-o do disco
+//(load) ou começando com todas as entradas livres. Os vetores indexados por
+//entrada do diretório crescem junto, e o setor em memória tem depois das entradas o
+//dir_slot de cada uma. Como dir_lookup e fs_list leem dir_sectors sem trava, ele
+//dobra de tamanho numa cópia, que só é publicada (com o novo dir_entries) pronta.
+int add_dir_sector(int cluster, int load)
+{
+	int n = dir_nsectors + 1;
+	int cap = n > dir_cap ? 2 * n : dir_cap;
+	dir_entry **sectors = cap > dir_cap ? malloc(cap * sizeof(dir_entry *)) : dir_sectors;
+	int *clusters = realloc(dir_clusters, n * sizeof(int));
+	char *dirty = realloc(dir_dirty, n);
+	int *jdirs = realloc(journal_dirs, n * dir_per_cluster * sizeof(int));
+	char *jmark = realloc(journal_dir_mark, n * dir_per_cluster);
+
+	if(clusters != NULL) dir_clusters = clusters;
+	if(dirty != NULL) dir_dirty = dirty;
+	if(jdirs != NULL) journal_dirs = jdirs;
+	if(jmark != NULL) journal_dir_mark = jmark;
+
+	dir_entry *entries = malloc(cluster_size + dir_per_cluster * sizeof(dir_slot));
+	if(sectors == NULL || clusters == NULL || dirty == NULL || jdirs == NULL || jmark == NULL || entries == NULL){
+		printf("Erro: Memória insuficiente para o diretório\n");
+		if(sectors != dir_sectors) free(sectors);
+		free(entries);
+		return 0;
+	}
+
+	if(!load){
+		memset(entries, 0, cluster_size);
+	}else if(!read_clusters(cluster, 1, (char *) entries)){
+		if(sectors != dir_sectors) free(sectors);
+		free(entries);
+		return 0;
+	}
+
+	dir_slot *slots = (dir_slot *) &entries[dir_per_cluster];
+	for (int i = 0; i < dir_per_cluster; i++)
+	{
+		slots[i].open_count = 0;
+		slots[i].hash_next = -1;
+	}
+
+	sectors[dir_nsectors] = entries;
+	if(sectors != dir_sectors){
+		if(dir_nsectors > 0) memcpy(sectors, dir_sectors, dir_nsectors * sizeof(dir_entry *));
+		if(dir_sectors != NULL) retire(dir_sectors);
+		__atomic_store_n(&dir_sectors, sectors, __ATOMIC_RELEASE);
+		dir_cap = cap;
+	}
+	dir_clusters[dir_nsectors] = cluster;
+	dir_dirty[dir_nsectors] = !load;
+	memset(&journal_dir_mark[dir_entries], 0, dir_per_cluster);
+
+	dir_nsectors = n;
+	__atomic_store_n(&dir_entries, n * dir_per_cluster, __ATOMIC_RELEASE);
+	return 1;
+}
+
+//Carrega a cadeia de clusters do diretório, um cluster de cada vez.
+//Devolve 0 se a cadeia for inválida.
+int load_dir()
+{
+	unsigned int cluster = dir_start;
+
+	release_dir();
+	while(1)
+	{
+		if(!add_dir_sector(cluster, 1)) return 0;
+
+		cluster = fat_get(cluster);
+		if(cluster == DIREND) return 1;
+
+		if(cluster < (unsigned int) FatDirSize || cluster >= (unsigned int) data_clusters || dir_nsectors >= data_clusters) return 0;
+	}
+}
+
+//Aumenta o diretório em um cluster, alocado de preferência logo depois do último.
+//Devolve a primeira entrada do novo cluster ou -1.
+int grow_dir()
+{
+	int last = dir_clusters[dir_nsectors - 1];
+	int len;
+
+	int cluster = alloc_extent(last, 1, &len);
+	if(cluster == -1) return -1;
+
+	//O novo setor, vazio, vai direto para o disco: o cluster estava livre, e só
+	//passa a fazer parte do diretório quando o encadeamento chegar ao journal
+	if(!add_dir_sector(cluster, 0) || !write_clusters(cluster, 1, (char *) dir_sectors[dir_nsectors - 1])){
+		if(dir_nsectors > 0 && dir_clusters[dir_nsectors - 1] == cluster){
+			retire(dir_sectors[--dir_nsectors]);
+			__atomic_store_n(&dir_entries, dir_nsectors * dir_per_cluster, __ATOMIC_RELEASE);
+		}
+		fat_set(cluster, FAT_FREE);
+		return -1;
+	}
+	dir_dirty[dir_nsectors - 1] = 0;
+	fat_set(cluster, DIREND);
+	fat_set(last, cluster);
+
+	if(dir_entries > dir_hash->size) build_dir_index();
+
+	return (dir_nsectors - 1) * dir_per_cluster;
+}
+
+//void print_dir() {
+//	for (int i = 0; i < dir_entries; i++){
+//    	printf("%d: %d %d %d\n", i, ENTRY(i).first_block, ENTRY(i).used, ENTRY(i).size);
+//	}
+//}
+//
+
+//Cria a entrada do diretório (e o primeiro bloco) de um novo arquivo vazio, com as
+//flags dadas. Com source diferente de -1, a entrada é uma cópia da entrada source,
+//que compartilha a cadeia de clusters dela. Devolve o índice da entrada ou -1 em caso
+//de erro. Chamada com o nome travado, e sem dir_mutex e alloc_mutex.
+int create_file(char* file_name, int source, int flags) {
+	//Operação apenas possível em disco formatado
+	if(!formatado){
+		printf("Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
+		return -1;
+	}
+
+	//Checando o tamanho do nome do arquivo
+	if(strlen(file_name) > 24)
+	{
+		printf("Erro: Nome do arquivo deve conter apenas 24 caracteres\n");
+		return -1;
+	}
+	
+	//checagem de nome repetido
+	if(dir_lookup(file_name) != -1){
+		//nome de arquivo igual causa erro
+		printf("Erro: Já existe um arquivo com esse nome.\n");
+		return -1;
+	}
+
+	//Nova entrada no dir
+  	dir_entry new;
+  	memset(&new, 0, sizeof(new));
+  	new.used = 1;
+  	strcpy(new.name, file_name);
+  	new.size = 0; 
+	new.flags = flags;
+
+	dir_lock();
+	alloc_lock();
+
+	//Checagem se é possível adicionar mais arquivos 
+	int new_dir_index = find_first_empty_dir();
+	int first_block = -1;
+	if(new_dir_index == -1)
+	{
+		printf("Erro: Não é possível criar mais arquivos\n");
+	}
+	else if(source != -1)
+	{
+		first_block = ENTRY(source).first_block;
+		new.size = ENTRY(source).size;
+		new.flags = ENTRY(source).flags;
+		new.index_block = ENTRY(source).index_block;
+		if(share_add(first_block, 1) == -1){
+			first_block = -1;
+		}else if(new.index_block != 0 && share_add(new.index_block, 1) == -1){
+			share_add(first_block, -1);
+			first_block = -1;
+		}
+	}
+	else if((first_block = alloc_cluster()) == -1)
+	{
+		printf("Erro: Não há espaço o suficiente em disco\n");
+	}
+
+	if(first_block != -1)
+	{
+	  	new.first_block = first_block;
+	  	ENTRY(new_dir_index) = new;
+		mark_dir_dirty(new_dir_index);
+		dir_index_insert(new_dir_index);
+	}
+	dir_unlock();
+
+	//As procuras de nomes não esperam pelo journal
+	int ok = first_block != -1 && journal_commit();
+	alloc_unlock();
+
+	return ok ? new_dir_index : -1;
+}
+
+
+//Acrescenta ao mapa do arquivo o cluster block como seu cluster lógico lcn,
+//que deve ser o seguinte ao último do mapa
+int map_append(open_file *f, int lcn, int block)
+{
+	if(f->map_len > 0)
+	{
+		extent *e = &f->map[f->map_len - 1];
+		if(e->block + e->len == block)
+		{
+			e->len++;
+			return 1;
+		}
+	}
+
+	if(f->map_len == f->map_cap)
+	{
+		int cap = f->map_cap ? 2 * f->map_cap : 16;
+		extent *map = realloc(f->map, cap * sizeof(extent));
+		if(map == NULL)
+		{
+			printf("Erro: Memória insuficiente para o mapa do arquivo\n");
+			return 0;
+		}
+		f->map = map;
+		f->map_cap = cap;
+	}
+
+	f->map[f->map_len].lcn = lcn;
+	f->map[f->map_len].block = block;
+	f->map[f->map_len].len = 1;
+	f->map_len++;
+
+	return 1;
+}
+
+//Monta o mapa do arquivo, percorrendo uma única vez a sua cadeia na FAT
+int build_map(open_file *f)
+{
+	int block = ENTRY(f->slot).first_block;
+
+	f->map_len = 0;
+	f->map_hint = 0;
+	for(int lcn = 0; lcn < data_clusters; lcn++)
+	{
+		if(!map_append(f, lcn, block)) return 0;
+
+		unsigned int next = fat_get(block);
+		if(next == FAT_EOF) return 1;
+		if(next < (unsigned int) FatDirSize || next >= (unsigned int) data_clusters) break;
+		block = next;
+	}
+
+	printf("Erro: Cadeia do arquivo na FAT está corrompida\n");
+	return 0;
+}
+
+//Devolve o cluster físico do cluster lógico lcn do arquivo, ou -1 se o arquivo for
+//menor. Em run, se não for NULL, devolve quantos clusters contíguos começam ali.
+//Acessos sequenciais caem no trecho consultado por último ou no seguinte; os
+//demais são achados por busca binária no mapa.
+int lcn_to_cluster(open_file *f, int lcn, int *run)
+{
+	int i = -1;
+
+	for(int j = f->map_hint; j < f->map_len && j <= f->map_hint + 1; j++)
+	{
+		if(lcn >= f->map[j].lcn && lcn < f->map[j].lcn + f->map[j].len)
+		{
+			i = j;
+			break;
+		}
+	}
+
+	if(i == -1)
+	{
+		int lo = 0, hi = f->map_len - 1;
+		while(lo <= hi)
+		{
+			int mid = (lo + hi) / 2;
+			if(lcn < f->map[mid].lcn){
+				hi = mid - 1;
+			}else if(lcn >= f->map[mid].lcn + f->map[mid].len){
+				lo = mid + 1;
+			}else{
+				i = mid;
+				break;
+			}
+		}
+		if(i == -1) return -1;
+	}
+
+	f->map_hint = i;
+	if(run != NULL) *run = f->map[i].lcn + f->map[i].len - lcn;
+
+	return f->map[i].block + lcn - f->map[i].lcn;
+}
+
+//Fim lógico do arquivo: inclui os bytes que ainda estão no buffer de escrita
+long long file_end(open_file *f)
+{
+	if(f->mode == FS_R) return f->size;
+
+	return (long long) f->buf_lcn * cluster_size + f->len;
+}
+
+//Lê os próximos count clusters do arquivo a partir do cluster lógico lcn.
+//Cada trecho contíguo do mapa é lido numa única chamada.
+int read_chain(open_file *f, int lcn, char *buffer, int count)
+{
+	while(count > 0)
+	{
+		int run;
+		int block = lcn_to_cluster(f, lcn, &run);
+		if(block == -1) return 0;
+
+		int n = count < run ? count : run;
+		if(!read_clusters(block, n, buffer)) return 0;
+
+		buffer += n * cluster_size;
+		count -= n;
+		lcn += n;
+	}
+
+	return 1;
+}
+
+//Dá a um arquivo comprimido cópias próprias dos clusters compartilhados até o cluster
+//lógico upto, antes que os dados ou o encadeamento deles sejam alterados. Os grupos
+//ficam na cadeia da FAT, que só compartilha o fim, então são copiados os clusters de
+//shared_from até upto e a cópia continua no resto da cadeia, que segue compartilhado.
+//Os outros arquivos passam a ter um mapa de clusters (ver own_clusters).
+int unshare(open_file *f, int upto)
+{
+	//A outra cópia pode ter deixado de compartilhar clusters depois da abertura
+	while(f->shared_from < f->blocks && share_refs(lcn_to_cluster(f, f->shared_from, NULL)) == 1) f->shared_from++;
+	if(f->shared_from >= f->blocks) f->shared_from = NOT_SHARED;
+
+	if(upto >= f->blocks) upto = f->blocks - 1;
+	if(upto < f->shared_from) return 1;
+
+	int from = f->shared_from;
+	if(upto - from + 1 > free_clusters)
+	{
+		printf("Erro: Não há espaço o suficiente em disco\n");
+		return 0;
+	}
+
+	char *buffer = malloc(WRITEBATCH * cluster_size);
+	if(buffer == NULL)
+	{
+		printf("Erro: Memória insuficiente para copiar o arquivo\n");
+		return 0;
+	}
+
+	int prev = from > 0 ? lcn_to_cluster(f, from - 1, NULL) : -1;
+	int old = lcn_to_cluster(f, from, NULL);
+	int next = upto + 1 < f->blocks ? lcn_to_cluster(f, upto + 1, NULL) : -1;
+	int head = -1, tail = -1;
+	int ok = 1;
+
+	//Cópia em sequências contíguas de até WRITEBATCH clusters, encadeadas entre si
+	for (int lcn = from; ok && lcn <= upto; )
+	{
+		int want = upto - lcn + 1 < WRITEBATCH ? upto - lcn + 1 : WRITEBATCH;
+		int len;
+		int start = alloc_extent(tail != -1 ? tail : prev != -1 ? prev : old, want, &len);
+
+		if(start == -1 || !read_chain(f, lcn, buffer, len) || !write_clusters(start, len, buffer))
+		{
+			for (int i = 0; start != -1 && i < len; i++) fat_set(start + i, FAT_FREE);
+			ok = 0;
+			break;
+		}
+		for (int i = 0; i < len; i++)
+		{
+			if(tail == -1) head = start + i;
+			else fat_set(tail, start + i);
+			tail = start + i;
+		}
+		lcn += len;
+	}
+	free(buffer);
+
+	if(!ok)
+	{
+		//Desfaz a cópia: o arquivo continua com os clusters compartilhados
+		while(head != -1)
+		{
+			int c = head;
+			head = c == tail ? -1 : (int) fat_get(c);
+			fat_set(c, FAT_FREE);
+		}
+		printf("Erro: Não foi possível copiar os clusters compartilhados\n");
+		return 0;
+	}
+
+	//A cópia entra no lugar dos clusters compartilhados, que ficam com a outra cadeia
+	fat_set(tail, next == -1 ? FAT_EOF : (unsigned int) next);
+	if(next != -1) share_add(next, 1);
+	share_add(old, -1);
+	if(prev == -1)
+	{
+		ENTRY(f->slot).first_block = head;
+		mark_dir_dirty(f->slot);
+	}
+	else
+	{
+		fat_set(prev, head);
+	}
+
+	if(next == -1)
+	{
+		f->last_block = tail;
+		f->shared_from = NOT_SHARED;
+	}
+	else
+	{
+		f->shared_from = upto + 1;
+	}
+
+	return build_map(f);
+}
+
+//Grava count clusters de data numa cadeia nova, alocada perto do cluster near.
+//Devolve o primeiro cluster da cadeia ou -1.
+int write_new_chain(int near, char *data, int count)
+{
+	int head = -1, tail = -1;
+
+	if(count > free_clusters)
+	{
+		printf("Erro: Não há espaço o suficiente em disco\n");
+		return -1;
+	}
+
+	while(count > 0)
+	{
+		int len;
+		int start = alloc_extent(tail != -1 ? tail : near, count, &len);
+
+		if(start == -1 || !write_clusters(start, len, data))
+		{
+			for (int i = 0; start != -1 && i < len; i++) fat_set(start + i, FAT_FREE);
+			while(head != -1)
+			{
+				int c = head;
+				head = c == tail ? -1 : (int) fat_get(c);
+				fat_set(c, FAT_FREE);
+			}
+			return -1;
+		}
+		for (int i = 0; i < len; i++)
+		{
+			if(tail == -1) head = start + i;
+			else fat_set(tail, start + i);
+			tail = start + i;
+		}
+		data += len * cluster_size;
+		count -= len;
+	}
+
+	return head;
+}
+
+//Lê o índice de grupos de um arquivo comprimido, um registro por grupo do tamanho
+//atual do arquivo
+int load_groups(open_file *f)
+{
+	int n = (ENTRY(f->slot).size + GROUP_SIZE - 1) / GROUP_SIZE;
+
+	f->groups = malloc((n + 1) * sizeof(zgroup));
+	if(f->groups == NULL)
+	{
+		printf("Erro: Memória insuficiente para o índice do arquivo\n");
+		return 0;
+	}
+	f->groups_cap = n + 1;
+	f->ngroups = n;
+
+	if(!read_meta_chain(ENTRY(f->slot).index_block, (char *) f->groups, n * sizeof(zgroup)))
+	{
+		printf("Erro: Índice do arquivo comprimido está corrompido\n");
+		return 0;
+	}
+
+	for (int k = 0; k < n; k++)
+	{
+		zgroup *g = &f->groups[k];
+		if(g->lcn < 0 || g->clusters < 1 || g->lcn + g->clusters > f->blocks ||
+		   g->bytes < 1 || g->bytes > g->clusters * cluster_size || g->length < 1 || g->length > GROUP_SIZE)
+		{
+			printf("Erro: Índice do arquivo comprimido está corrompido\n");
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+//Grava o índice de grupos (e o tamanho do arquivo) numa cadeia nova e libera a
+//anterior, que pode estar compartilhada com uma cópia do arquivo
+int store_groups(open_file *f)
+{
+	int bytes = f->ngroups * sizeof(zgroup);
+	int count = (bytes + cluster_size - 1) / cluster_size;
+	unsigned int old = ENTRY(f->slot).index_block;
+	int head = 0;
+
+	if(count > 0)
+	{
+		char *buffer = calloc(count, cluster_size);
+		if(buffer == NULL)
+		{
+			printf("Erro: Memória insuficiente para o índice do arquivo\n");
+			return 0;
+		}
+		memcpy(buffer, f->groups, bytes);
+		head = write_new_chain(f->last_block, buffer, count);
+		free(buffer);
+		if(head == -1) return 0;
+	}
+
+	ENTRY(f->slot).index_block = head;
+	ENTRY(f->slot).size = file_end(f);
+	mark_dir_dirty(f->slot);
+	if(old != 0) free_chain(old);
+	f->index_dirty = 0;
+
+	return 1;
+}
+
+//Lê e descomprime o grupo k do arquivo em out (com espaço para GROUP_SIZE bytes).
+//Devolve o tamanho do grupo descomprimido ou -1.
+int load_group(open_file *f, int k, char *out)
+{
+	zgroup *g = &f->groups[k];
+	int clusters = (g->bytes + cluster_size - 1) / cluster_size;
+
+	//Grupo gravado sem compressão
+	if(g->bytes == g->length)
+	{
+		return read_chain(f, g->lcn, out, clusters) ? g->length : -1;
+	}
+
+	if(!read_chain(f, g->lcn, f->zbuf, clusters)) return -1;
+	if(lz_decompress(f->zbuf, g->bytes, out, GROUP_SIZE) != g->length)
+	{
+		printf("Erro: Grupo comprimido está corrompido\n");
+		return -1;
+	}
+
+	return g->length;
+}
+
+//Coloca count clusters novos na cadeia do arquivo, antes do seu cluster lógico at
+//(no fim, se at for o total de clusters), e refaz o mapa
+int insert_clusters(open_file *f, int at, int count)
+{
+	int tail = lcn_to_cluster(f, at - 1, NULL);
+	unsigned int next = fat_get(tail);
+
+	if(count > free_clusters)
+	{
+		printf("Erro: Não há espaço o suficiente em disco\n");
+		return 0;
+	}
+
+	for (int left = count; left > 0; )
+	{
+		int len;
+		int start = alloc_extent(tail, left, &len);
+		if(start == -1) return 0;
+
+		for (int i = 0; i < len; i++)
+		{
+			fat_set(tail, start + i);
+			tail = start + i;
+		}
+		left -= len;
+	}
+
+	//A referência ao resto da cadeia passa para o último cluster inserido
+	fat_set(tail, next);
+	if(next == FAT_EOF) f->last_block = tail;
+	f->blocks += count;
+
+	return build_map(f);
+}
+
+//Comprime os length bytes de data como o grupo k do arquivo (um grupo novo, se k for
+//o total de grupos) e grava o resultado nos clusters do grupo. Um grupo que não cabe
+//mais nos seus clusters ganha clusters inseridos logo depois deles na cadeia, e os
+//grupos seguintes andam na cadeia; um grupo que diminuiu fica com os que sobraram.
+int store_group(open_file *f, int k, char *data, int length)
+{
+	//data e zbuf são do descritor: a compressão é feita sem alloc_mutex
+	char *src = f->zbuf;
+	alloc_unlock();
+	int bytes = lz_compress(data, length, f->zbuf, length - 1);
+	alloc_lock();
+
+	//Sem ganho, o grupo é gravado como está
+	if(bytes == 0)
+	{
+		src = data;
+		bytes = length;
+	}
+	int need = (bytes + cluster_size - 1) / cluster_size;
+	memset(&src[bytes], 0, need * cluster_size - bytes);
+
+	if(k == f->ngroups)
+	{
+		if(f->ngroups == f->groups_cap)
+		{
+			int cap = 2 * f->groups_cap;
+			zgroup *groups = realloc(f->groups, cap * sizeof(zgroup));
+			if(groups == NULL)
+			{
+				printf("Erro: Memória insuficiente para o índice do arquivo\n");
+				return 0;
+			}
+			f->groups = groups;
+			f->groups_cap = cap;
+		}
+		zgroup *prev = k > 0 ? &f->groups[k - 1] : NULL;
+		f->groups[k].lcn = prev != NULL ? prev->lcn + prev->clusters : 0;
+		f->groups[k].clusters = 0;
+		f->ngroups++;
+	}
+	zgroup *g = &f->groups[k];
+
+	//O último grupo pode crescer para os clusters que sobram no fim da cadeia
+	//(o primeiro cluster, reservado na criação, ou os que um grupo deixou)
+	if(k == f->ngroups - 1 && need > g->clusters)
+	{
+		int spare = f->blocks - g->lcn - g->clusters;
+		g->clusters += need - g->clusters < spare ? need - g->clusters : spare;
+	}
+	int insert = need > g->clusters ? need - g->clusters : 0;
+	int at = g->lcn + g->clusters;
+
+	//Clusters compartilhados que serão reescritos, ou cujo encadeamento muda, passam a
+	//ser só do arquivo
+	int upto = insert > 0 ? at - 1 : g->lcn + need - 1;
+	if(f->shared_from < f->blocks && !unshare(f, upto)) return 0;
+
+	if(insert > 0)
+	{
+		if(!insert_clusters(f, at, insert)) return 0;
+		g->clusters += insert;
+		for (int j = k + 1; j < f->ngroups; j++) f->groups[j].lcn += insert;
+	}
+
+	for (int lcn = g->lcn, left = need; left > 0; )
+	{
+		int run;
+		int block = lcn_to_cluster(f, lcn, &run);
+		if(block == -1) return 0;
+
+		int n = left < run ? left : run;
+		if(!write_clusters(block, n, src)) return 0;
+		src += n * cluster_size;
+		lcn += n;
+		left -= n;
+	}
+
+	g->bytes = bytes;
+	g->length = length;
+	f->index_dirty = 1;
+
+	return 1;
+}
+
+//Grava o grupo que está no buffer de escrita de um arquivo comprimido. O grupo
+//completo sai do buffer; com all, um grupo incompleto também é gravado, mas continua
+//no buffer para que as próximas escritas o completem.
+int flush_group(open_file *f, int all)
+{
+	int full = f->len == GROUP_SIZE;
+
+	if(f->dirty_from < f->len && (full || all))
+	{
+		if(!store_group(f, f->buf_lcn / WRITEBATCH, f->conteudo, f->len)) return 0;
+		f->dirty_from = f->len;
+	}
+
+	if(full)
+	{
+		f->buf_lcn += WRITEBATCH;
+		f->len = 0;
+		f->dirty_from = 0;
+	}
+
+	return 1;
+}
+
+//Escreve nos grupos de um arquivo comprimido que estão antes do buffer de escrita:
+//cada grupo atingido é descomprimido na janela, alterado e comprimido de novo.
+//Devolve os bytes escritos ou -1.
+int write_groups(open_file *f, char *buffer, int size, long long offset, long long buf_start)
+{
+	int done = 0;
+
+	while(done < size && offset + done < buf_start)
+	{
+		long long pos = offset + done;
+		int k = pos / GROUP_SIZE;
+		int in = pos % GROUP_SIZE;
+		int length;
+
+		if(f->win_len > 0 && f->win_start == (long long) k * GROUP_SIZE)
+		{
+			length = f->win_len;
+		}
+		else
+		{
+			f->win_len = 0;
+			if((length = load_group(f, k, f->janela)) == -1) return -1;
+		}
+
+		int n = length - in < size - done ? length - in : size - done;
+		memcpy(&f->janela[in], &buffer[done], n);
+		if(!store_group(f, k, f->janela, length))
+		{
+			f->win_len = 0;
+			return -1;
+		}
+
+		//A janela fica com o grupo alterado
+		f->win_start = (long long) k * GROUP_SIZE;
+		f->win_len = length;
+		done += n;
+	}
+
+	return done;
+}
+
+//Refaz o mapa de trechos de um arquivo com deduplicação (ou de uma cópia com mapa de
+//clusters) a partir do seu mapa de clusters
+int dedup_map(open_file *f)
+{
+	f->map_len = 0;
+	f->map_hint = 0;
+	f->map_stale = 0;
+
+	for (int lcn = 0; lcn < f->blocks; lcn++)
+	{
+		if(!map_append(f, lcn, f->dmap[lcn].cluster)) return 0;
+	}
+
+	return 1;
+}
+
+//Garante espaço em dmap para mais um registro, depois dos blocks que ele já tem
+int dmap_grow(open_file *f)
+{
+	if(f->blocks < f->dmap_cap) return 1;
+
+	int cap = f->dmap_cap ? 2 * f->dmap_cap : 64;
+	dmap_entry *dmap = realloc(f->dmap, cap * sizeof(dmap_entry));
+	if(dmap == NULL)
+	{
+		printf("Erro: Memória insuficiente para o mapa do arquivo\n");
+		return 0;
+	}
+	f->dmap = dmap;
+	f->dmap_cap = cap;
+
+	return 1;
+}
+
+//Acrescenta o cluster c aos que saem do mapa do arquivo, liberados no fechamento
+int add_dead(open_file *f, int c)
+{
+	if(f->ndead == f->dead_cap)
+	{
+		int cap = f->dead_cap ? 2 * f->dead_cap : 64;
+		int *dead = realloc(f->dead, cap * sizeof(int));
+		if(dead == NULL)
+		{
+			printf("Erro: Memória insuficiente para o mapa do arquivo\n");
+			return 0;
+		}
+		f->dead = dead;
+		f->dead_cap = cap;
+	}
+	f->dead[f->ndead++] = c;
+
+	return 1;
+}
+
+//Decide onde fica o novo conteúdo data, de hash hash (cluster_hash, calculado por quem
+//chama sem alloc_mutex), do cluster lógico lcn de um arquivo com deduplicação. Se
+//algum cluster já tem esse conteúdo (mesmo hash e os mesmos bytes),
+//ele ganha uma referência e não há nada a gravar (*write = 0). Senão, o conteúdo vai
+//para o próprio cluster antigo, se só este arquivo o usa, ou para um cluster novo
+//(*write = 1). Os pending clusters a partir de pending_block ainda não foram gravados:
+//o conteúdo deles está em pending_data. Devolve o cluster escolhido ou -1.
+int dedup_place(open_file *f, int lcn, char *data, unsigned int hash, int *write, int pending_block, int pending, char *pending_data)
+{
+	int old = lcn < f->blocks ? f->dmap[lcn].cluster : -1;
+	unsigned int old_hash = old != -1 ? f->dmap[lcn].hash : 0;
+	int block = -1;
+
+	*write = 0;
+	for (int i = hash & (dedup_cap - 1); dedup_cap > 0 && dedup_table[i].cluster != -1; i = (i + 1) & (dedup_cap - 1))
+	{
+		int c = dedup_table[i].cluster;
+		char *content = f->zbuf;
+
+		if(dedup_table[i].hash != hash) continue;
+		if(c >= pending_block && c < pending_block + pending){
+			content = &pending_data[(c - pending_block) * cluster_size];
+		}else if(!read_clusters(c, 1, f->zbuf)){
+			return -1;
+		}
+		if(!memcmp(content, data, cluster_size)){
+			block = c;
+			break;
+		}
+	}
+
+	//O conteúdo não mudou
+	if(block != -1 && block == old) return old;
+
+	if(block != -1)
+	{
+		if(dedup_ref(hash, block, 1) == -1) return -1;
+	}
+	else if(old != -1 && dedup_refs(old_hash, old) == 1)
+	{
+		//O cluster antigo é só deste arquivo: é reescrito no lugar, com o hash novo
+		dedup_ref(old_hash, old, -1);
+		if(dedup_ref(hash, old, 1) == -1) return -1;
+		f->dmap[lcn].hash = hash;
+		f->dmap_dirty = 1;
+		*write = 1;
+		return old;
+	}
+	else
+	{
+		if(f->ext_left == 0)
+		{
+			f->ext_next = reserve_extent(f->last_block, WRITEBATCH, &f->ext_left);
+			if(f->ext_next == -1)
+			{
+				f->ext_left = 0;
+				printf("Erro: Não há espaço o suficiente em disco\n");
+				return -1;
+			}
+		}
+		block = f->ext_next++;
+		f->ext_left--;
+		claim_cluster(block, DEDUPDATA);
+		f->last_block = block;
+		if(dedup_ref(hash, block, 1) == -1) return -1;
+		*write = 1;
+	}
+
+	//O cluster antigo perde esta referência; sem nenhuma, ele só é liberado junto com o
+	//mapa novo, no fechamento, porque o mapa no disco ainda aponta para ele
+	if(old != -1 && dedup_ref(old_hash, old, -1) == 0 && !add_dead(f, old)) return -1;
+
+	if(lcn == f->blocks)
+	{
+		if(!dmap_grow(f)) return -1;
+		f->blocks++;
+		if(!f->map_stale && !map_append(f, lcn, block)) return -1;
+	}
+	else
+	{
+		f->map_stale = 1;
+	}
+	f->dmap[lcn].cluster = block;
+	f->dmap[lcn].hash = hash;
+	f->dmap_dirty = 1;
+
+	return block;
+}
+
+//Grava o buffer de escrita de um arquivo com deduplicação, cluster por cluster (ver
+//dedup_place); os clusters a gravar que ficam em sequência no disco vão numa única
+//chamada. Com all, o último cluster incompleto também é gravado, completado com
+//zeros, mas continua no buffer para que as próximas escritas o completem.
+int flush_dedup(open_file *f, int all)
+{
+	int clusters = f->len / cluster_size;
+	int partial = f->len % cluster_size;
+	int run_block = -1, run_start = 0, run_len = 0;
+	int first = f->dirty_from / cluster_size;
+	unsigned int hashes[WRITEBATCH];
+
+	if(f->dirty_from >= f->len) return 1;
+
+	if(all && partial)
+	{
+		memset(&f->conteudo[f->len], 0, cluster_size - partial);
+		clusters++;
+	}
+
+	for (int i = first; i < clusters; i++)
+	{
+		//Os hashes de até WRITEBATCH clusters são calculados sem alloc_mutex. Antes de
+		//soltá-la, a sequência ainda não gravada vai para o disco: os clusters dela já
+		//estão no índice de conteúdo, e outro arquivo pode compará-los com os seus.
+		if((i - first) % WRITEBATCH == 0)
+		{
+			int n = clusters - i < WRITEBATCH ? clusters - i : WRITEBATCH;
+
+			if(run_len > 0 && !write_clusters(run_block, run_len, &f->conteudo[run_start * cluster_size])) return 0;
+			run_len = 0;
+			alloc_unlock();
+			for (int j = 0; j < n; j++) hashes[j] = cluster_hash(&f->conteudo[(i + j) * cluster_size]);
+			alloc_lock();
+		}
+
+		int write;
+		int block = dedup_place(f, f->buf_lcn + i, &f->conteudo[i * cluster_size], hashes[(i - first) % WRITEBATCH],
+		                        &write, run_block, run_len, &f->conteudo[run_start * cluster_size]);
+		if(block == -1) return 0;
+
+		if(run_len > 0 && (!write || block != run_block + run_len))
+		{
+			if(!write_clusters(run_block, run_len, &f->conteudo[run_start * cluster_size])) return 0;
+			run_len = 0;
+		}
+		if(write)
+		{
+			if(run_len == 0)
+			{
+				run_block = block;
+				run_start = i;
+			}
+			run_len++;
+		}
+	}
+
+	if(run_len > 0 && !write_clusters(run_block, run_len, &f->conteudo[run_start * cluster_size])) return 0;
+	if(f->map_stale && !dedup_map(f)) return 0;
+
+	//O cluster incompleto fica no início do buffer
+	if(partial)
+	{
+		int done = all ? clusters - 1 : clusters;
+		memmove(f->conteudo, &f->conteudo[done * cluster_size], partial);
+		f->buf_lcn += done;
+	}
+	else
+	{
+		f->buf_lcn += clusters;
+	}
+	f->len = partial;
+	f->dirty_from = all ? partial : 0;
+
+	return 1;
+}
+
+//Escreve nos clusters de um arquivo com deduplicação que estão antes do buffer de
+//escrita: cada cluster atingido é lido na janela, alterado e passa por dedup_place.
+//Devolve os bytes escritos ou -1.
+int write_dedup(open_file *f, char *buffer, int size, long long offset, long long buf_start)
+{
+	int done = 0;
+
+	while(done < size && offset + done < buf_start)
+	{
+		long long pos = offset + done;
+		int lcn = pos / cluster_size;
+		int in = pos % cluster_size;
+		int n = cluster_size - in < size - done ? cluster_size - in : size - done;
+		int write;
+
+		//O cluster é só lido (os outros arquivos que o usam não o alteram) e o hash é
+		//calculado sem alloc_mutex
+		unsigned int hash = 0;
+		f->win_len = 0;
+		alloc_unlock();
+		int ok = n == cluster_size || read_clusters(f->dmap[lcn].cluster, 1, f->janela);
+		if(ok){
+			memcpy(&f->janela[in], &buffer[done], n);
+			hash = cluster_hash(f->janela);
+		}
+		alloc_lock();
+		if(!ok) return -1;
+
+		int block = dedup_place(f, lcn, f->janela, hash, &write, -1, 0, NULL);
+		if(block == -1 || (write && !write_clusters(block, 1, f->janela))) return -1;
+		done += n;
+	}
+
+	if(f->map_stale && !dedup_map(f)) return -1;
+
+	return done;
+}
+
+//Grava o mapa de clusters (e o tamanho) de um arquivo com deduplicação numa cadeia
+//nova, que passa a ser a cadeia do arquivo, e libera a anterior, que pode estar
+//compartilhada com uma cópia do arquivo. Os clusters novos de uma cópia com mapa,
+//até aqui só reservados, passam a ocupar a FAT junto com o mapa.
+int store_dmap(open_file *f)
+{
+	int bytes = f->blocks * sizeof(dmap_entry);
+	int count = bytes > 0 ? (bytes + cluster_size - 1) / cluster_size : 1;
+	unsigned int old = ENTRY(f->slot).first_block;
+	char *buffer = calloc(count, cluster_size);
+
+	if(buffer == NULL)
+	{
+		printf("Erro: Memória insuficiente para o mapa do arquivo\n");
+		return 0;
+	}
+	memcpy(buffer, f->dmap, bytes);
+	int head = write_new_chain(f->last_block, buffer, count);
+	free(buffer);
+	if(head == -1) return 0;
+
+	for (int i = 0; f->clustermap && i < f->blocks; i++)
+	{
+		if(fat_get(f->dmap[i].cluster) == FAT_FREE) claim_cluster(f->dmap[i].cluster, FAT_EOF);
+	}
+	ENTRY(f->slot).first_block = head;
+	ENTRY(f->slot).size = file_end(f);
+	mark_dir_dirty(f->slot);
+	free_chain(old);
+	f->dmap_dirty = 0;
+
+	return 1;
+}
+
+//Passa um arquivo que compartilha clusters com outra cópia a ter um mapa de clusters
+//(DIR_CLUSTERMAP), antes da primeira alteração: daí em diante, um cluster compartilhado
+//que é reescrito é copiado sozinho (own_clusters) e os acrescentados não mexem na cadeia
+//da outra cópia. O mapa é gravado já, no mesmo grupo do journal que a entrada. Os
+//clusters que eram só do arquivo perdem o encadeamento; os compartilhados o mantêm para
+//quem ainda usa a cadeia.
+int map_file(open_file *f)
+{
+	int file = f->slot;
+	int n = (ENTRY(file).size + cluster_size - 1) / cluster_size;
+	if(n > f->blocks) n = f->blocks;
+
+	int count = n > 0 ? (n * sizeof(dmap_entry) + cluster_size - 1) / cluster_size : 1;
+	dmap_entry *dmap = calloc(n + 1, sizeof(dmap_entry));
+	char *own = malloc(n + 1);
+	char *buffer = calloc(count, cluster_size);
+	if(dmap == NULL || own == NULL || buffer == NULL)
+	{
+		free(dmap);
+		free(own);
+		free(buffer);
+		printf("Erro: Memória insuficiente para o mapa do arquivo\n");
+		return 0;
+	}
+
+	//Cada cluster ganha a referência do mapa. Os que vêm depois do primeiro compartilhado
+	//são alcançados pela cadeia da outra cópia, mesmo com uma só referência.
+	int added = 0;
+	int shared = 0;
+	while(added < n)
+	{
+		int c = lcn_to_cluster(f, added, NULL);
+		dmap[added].cluster = c;
+		shared |= share_refs(c) > 1;
+		own[added] = !shared;
+		if(share_add(c, 1) == -1) break;
+		added++;
+	}
+	memcpy(buffer, dmap, n * sizeof(dmap_entry));
+	int head = added == n ? write_new_chain(f->last_block, buffer, count) : -1;
+	free(buffer);
+	if(head == -1)
+	{
+		while(added > 0) share_add(dmap[--added].cluster, -1);
+		free(dmap);
+		free(own);
+		printf("Erro: Não foi possível copiar os clusters compartilhados\n");
+		return 0;
+	}
+
+	//Um tamanho além dos clusters gravados vinha do buffer de escrita, que continua nele
+	unsigned int old = ENTRY(file).first_block;
+	ENTRY(file).first_block = head;
+	ENTRY(file).flags |= DIR_CLUSTERMAP;
+	if(ENTRY(file).size > (long long) n * cluster_size) ENTRY(file).size = (long long) n * cluster_size;
+	mark_dir_dirty(file);
+
+	//Saem os encadeamentos que só o arquivo usava (o que sobra da cadeia além do tamanho
+	//é liberado) e a referência da entrada ao início da cadeia
+	for (int i = 0; i < n; i++)
+	{
+		unsigned int next = fat_get(dmap[i].cluster);
+		if(own[i] && next < (unsigned int) fat_entries)
+		{
+			fat_set(dmap[i].cluster, FAT_EOF);
+			free_chain(next);
+		}
+	}
+	free_chain(old);
+	free(own);
+
+	f->clustermap = 1;
+	f->dmap = dmap;
+	f->dmap_cap = n + 1;
+	f->blocks = n;
+	f->last_block = n > 0 ? dmap[n - 1].cluster : head;
+	f->shared_from = NOT_SHARED;
+
+	return dedup_map(f);
+}
+
+//Dá ao arquivo cópias próprias dos clusters compartilhados entre os clusters lógicos
+//from e upto, antes que eles sejam reescritos (ou, no acréscimo, que o encadeamento do
+//último mude). Um arquivo com a cadeia compartilhada passa antes a ter um mapa de
+//clusters (map_file); com o mapa, só os clusters compartilhados do trecho são copiados.
+//O antigo só perde a referência do arquivo no fechamento, junto com o mapa novo,
+//porque o mapa no disco ainda aponta para ele.
+int own_clusters(open_file *f, int from, int upto)
+{
+	if(!f->clustermap)
+	{
+		//A outra cópia pode ter deixado de compartilhar clusters depois da abertura
+		while(f->shared_from < f->blocks && share_refs(lcn_to_cluster(f, f->shared_from, NULL)) == 1) f->shared_from++;
+		if(f->shared_from >= f->blocks) f->shared_from = NOT_SHARED;
+
+		if((upto < f->blocks ? upto : f->blocks - 1) < f->shared_from) return 1;
+		if(!map_file(f)) return 0;
+	}
+
+	if(upto >= f->blocks) upto = f->blocks - 1;
+	if(from < 0) from = 0;
+
+	char *buffer = NULL;
+	int ok = 1;
+	for (int lcn = from; ok && lcn <= upto; )
+	{
+		if(share_refs(f->dmap[lcn].cluster) == 1)
+		{
+			lcn++;
+			continue;
+		}
+
+		//Os compartilhados em sequência são copiados juntos, de até WRITEBATCH em WRITEBATCH
+		int want = 1;
+		while(want < WRITEBATCH && lcn + want <= upto && share_refs(f->dmap[lcn + want].cluster) > 1) want++;
+
+		if(buffer == NULL && (buffer = malloc(WRITEBATCH * cluster_size)) == NULL)
+		{
+			printf("Erro: Memória insuficiente para copiar o arquivo\n");
+			return 0;
+		}
+
+		int len;
+		int start = reserve_extent(lcn > 0 ? f->dmap[lcn - 1].cluster : f->last_block, want, &len);
+		if(start == -1)
+		{
+			printf("Erro: Não há espaço o suficiente em disco\n");
+			ok = 0;
+			break;
+		}
+		if(!read_chain(f, lcn, buffer, len) || !write_clusters(start, len, buffer))
+		{
+			for (int i = 0; i < len; i++) unreserve_cluster(start + i);
+			printf("Erro: Não foi possível copiar os clusters compartilhados\n");
+			ok = 0;
+			break;
+		}
+
+		for (int i = 0; i < len; i++, lcn++)
+		{
+			if(!add_dead(f, f->dmap[lcn].cluster))
+			{
+				while(i < len) unreserve_cluster(start + i++);
+				ok = 0;
+				break;
+			}
+			f->dmap[lcn].cluster = start + i;
+			f->dmap_dirty = 1;
+			f->map_stale = 1;
+		}
+	}
+	free(buffer);
+
+	//O mapa de trechos passa a apontar para as cópias
+	if(f->map_stale && !dedup_map(f)) return 0;
+
+	return ok;
+}
+
+//Grava os setores do trecho [lo, hi) do buffer de escrita que caem nos clusters
+//first..last-1 do buffer, guardados em sequência no disco a partir do cluster block
+int write_run(open_file *f, int block, int first, int last, int lo, int hi)
+{
+	int from = first * cluster_size > lo ? first * cluster_size : lo;
+	int to = last * cluster_size < hi ? last * cluster_size : hi;
+
+	return write_sectors(block * cluster_sectors + (from - first * cluster_size) / SECTORSIZE,
+	                     (to - from) / SECTORSIZE, &f->conteudo[from]);
+}
+
+//Grava o trecho do buffer que cai nos clusters first..last-1 (ver write_run), sem
+//alloc_mutex, e só depois liga ao fim da cadeia os clusters novos entre eles. Se a
+//gravação falha, os clusters novos são liberados.
+int write_and_link(open_file *f, int block, int first, int last, int lo, int hi)
+{
+	alloc_unlock();
+	int ok = write_run(f, block, first, last, lo, hi);
+	alloc_lock();
 
-#define CLUSTERSIZE 4096     // Tamanho de um cluster da FAT em bytes
-#define FATCLUSTERS 65536    // Tamanho total da FAT em short (bytes/2)
-#define DIRENTRIES 128       // Quantidade de arquivos no diretório
+	for (int i = first; i < last; i++)
+	{
+		int lcn = f->buf_lcn + i;
+		int c = block + i - first;
+
+		if(lcn < f->blocks) continue;
+		if(!ok)
+		{
+			unreserve_cluster(c);
+			continue;
+		}
+
+		//Numa cópia com mapa, o cluster novo só entra no mapa, gravado no fechamento
+		if(f->clustermap)
+		{
+			if(!dmap_grow(f))
+			{
+				unreserve_cluster(c);
+				ok = 0;
+				continue;
+			}
+			f->dmap[f->blocks].cluster = c;
+			f->dmap[f->blocks].hash = 0;
+			f->dmap_dirty = 1;
+		}
+		else
+		{
+			//Atualizando apontador pro próximo setor com informações
+			claim_cluster(c, FAT_EOF);
+			fat_set(f->last_block, c);
+		}
+		f->last_block = c;
+		f->blocks++;
+		if(!map_append(f, lcn, c)) return 0;
+	}
+
+	return ok;
+}
+
+//Grava o buffer de escrita nos clusters do arquivo. Clusters que ainda não existem são
+//alocados em sequências contíguas e ligados ao fim da cadeia depois de gravados; só os
+//setores alterados desde a última gravação são escritos. Com all, o último cluster incompleto também é
+//gravado (até o setor do fim do arquivo, completado com zeros), mas continua no buffer
+//para que as próximas escritas o completem. pending indica quantos bytes ainda
+//vão chegar nesta chamada, para que a reserva de clusters já comporte o restante.
+int flush_write(open_file *f, int all, long long pending)
+{
+	int file = f->slot;
+	int clusters = f->len / cluster_size;
+	int partial = f->len % cluster_size;
+	int pending_clusters = (pending + cluster_size - 1) / cluster_size;
+	int hi = clusters * cluster_size;	//Fim do trecho do buffer a gravar
 
-unsigned short fat[FATCLUSTERS];
+	if(f->compressed) return flush_group(f, all);
+	if(f->dedup) return flush_dedup(f, all);
+	if(f->dirty_from >= f->len) return 1;
 
-typedef struct {
-  char used;
-  char name[25];
-  unsigned short first_block;
-  int size;
-} dir_entry;
+	if(all && partial)
+	{
+		hi = (f->len + SECTORSIZE - 1) / SECTORSIZE * SECTORSIZE;
+		memset(&f->conteudo[f->len], 0, hi - f->len);
+		clusters++;
+	}
 
-dir_entry dir[DIRENTRIES];
+	//Início do trecho a gravar: o setor do primeiro byte alterado
+	int lo = f->dirty_from / SECTORSIZE * SECTORSIZE;
+	if(lo >= hi) return 1;
+
+	//Clusters compartilhados com outra cópia que serão reescritos (ou cujo encadeamento
+	//muda, no acréscimo) passam a ser só do arquivo
+	if((f->clustermap || f->shared_from < f->blocks) &&
+	   !own_clusters(f, f->buf_lcn + lo / cluster_size, f->buf_lcn + clusters - 1)) return 0;
+
+	//O primeiro bloco foi reservado na criação, sem saber o tamanho do arquivo. Se não
+	//der para continuar logo depois dele, o início do arquivo é movido para uma
+	//sequência livre que comporte a escrita inteira.
+	int first = ENTRY(file).first_block;
+	if(!f->clustermap && ENTRY(file).size == 0 && f->blocks == 1 && f->buf_lcn == 0 &&
+	   clusters + pending_clusters > 1 && !cluster_is_free(first + 1))
+	{
+		int run_len;
+		int run = find_free_run(clusters + pending_clusters, &run_len);
 
-int formatado = 0;
-char file_status[DIRENTRIES] = {'F'};
+		if(run_len == clusters + pending_clusters)
+		{
+			fat_set(run, FAT_EOF);
+			fat_set(first, FAT_FREE);
+			ENTRY(file).first_block = f->last_block = run;
+			mark_dir_dirty(file);
+			f->map_len = 0;
+			map_append(f, 0, run);
+		}
+	}
 
+	//Início da sequência atual de clusters contíguos, escrita de uma só vez
+	int run_block = -1;
+	int run_start = 0;
+	int prev = -1;
 
-#define MAXFILE CLUSTERSIZE * 200
+	for (int i = lo / cluster_size; i < clusters; i++) {
+		int lcn = f->buf_lcn + i;
+		int block;
 
-//#define MAXFILE 10     
-char writeBuff[MAXFILE];
+		if(lcn < f->blocks)
+		{
+			//Cluster que já pertence ao arquivo é reescrito no lugar
+			block = lcn_to_cluster(f, lcn, NULL);
+			if(block == -1) return 0;
+		}
+		else
+		{
+			//Reserva de uma vez uma sequência contígua para o que falta escrever (no mínimo
+			//um lote inteiro, para que escritas intercaladas não se misturem no disco)
+			if(f->ext_left == 0)
+			{
+				int want = clusters - i + pending_clusters;
+				if(want < WRITEBATCH) want = WRITEBATCH;
+
+				f->ext_next = reserve_extent(f->last_block, want, &f->ext_left);
+				if(f->ext_next == -1)
+				{
+					f->ext_left = 0;
+					printf("Erro: Não há espaço o suficiente em disco\n");
+					return 0;
+				}
+			}
+			block = f->ext_next++;
+			f->ext_left--;
+		}
 
-typedef struct{
-  char conteudo[MAXFILE];
-  int file_id;
-  int pos_read;
-  
-} readBuffer;
+		//Fim da sequência contígua: escreve todos os seus setores numa única chamada
+		if(run_block != -1 && block != prev + 1)
+		{
+			if(!write_and_link(f, run_block, run_start, i, lo, hi)) return 0;
+			run_block = -1;
+		}
+		if(run_block == -1)
+		{
+			run_block = block;
+			run_start = i;
+		}
+		prev = block;
+	}
 
-readBuffer readBuff;
+	if(!write_and_link(f, run_block, run_start, clusters, lo, hi)) return 0;
 
+	//Ajustando o tamanho do arquivo (o de uma cópia com mapa vai junto com o mapa)
+	if(!f->clustermap && file_end(f) > ENTRY(file).size)
+	{
+		ENTRY(file).size = file_end(f);
+		mark_dir_dirty(file);
+	}
 
-int FatDirSize = 32+1;
+	//O cluster incompleto fica no início do buffer
+	if(partial)
+	{
+		int done = all ? clusters - 1 : clusters;
+		memmove(f->conteudo, &f->conteudo[done * cluster_size], partial);
+		f->buf_lcn += done;
+	}
+	else
+	{
+		f->buf_lcn += clusters;
+	}
+	f->len = partial;
+	f->dirty_from = all ? partial : 0;
 
-/*FUNÇÕES AUXILIARES*/
+	return 1;
+}
 
-//Itera sobre a lista de diretórios afim de achar o primeiro indice livre 
-int find_first_empty_dir()
+//Termina a escrita do arquivo: grava o resto do buffer, devolve os clusters
+//reservados e não usados e escreve as modificações da FAT e do diretório
+int finish_write(open_file *f)
 {
-  	for (int i = 0; i < DIRENTRIES; i++)
-  	{
-    	if(dir[i].used == 0) return i;
-  	}
+	int ok = flush_write(f, 1, 0);
 
-  	return -1 ;
-}
+	while(f->ext_left > 0)
+	{
+		unreserve_cluster(f->ext_next++);
+		f->ext_left--;
+	}
 
-//Itera sobre a fat para achar um bloco sem nada escrito. 
-//Parâmetro de index para caso queiramos começar a partir de um certo ponto
-int find_first_empty_fat_index(int last_seen_index)
-{ 
+	//O índice de grupos de um arquivo comprimido e o mapa de um arquivo com
+	//deduplicação vão junto com o tamanho
+	if(ok && f->index_dirty) ok = store_groups(f);
+	if(ok && f->dmap_dirty){
+		ok = store_dmap(f);
+	}else if(ok && (f->dedup || f->clustermap) && file_end(f) > ENTRY(f->slot).size){
+		//Zeros acrescentados ao último cluster, completado com zeros, não mudam o mapa
+		ENTRY(f->slot).size = file_end(f);
+		mark_dir_dirty(f->slot);
+	}
 
-  	//Acha o primeiro bloco livre indicado por 1
-  	for (int i = 0; i < FATCLUSTERS; i++)
-  	{
-      	//TODO
-      	if(fat[i] == 1 && i != last_seen_index) return i;
-  	}
+	//Clusters deduplicados que ficaram sem referências, agora fora do mapa no disco; numa
+	//cópia com mapa, os substituídos por cópias perdem a referência do arquivo
+	for (int i = 0; ok && i < f->ndead; i++)
+	{
+		if(f->clustermap) free_chain(f->dead[i]);
+		else fat_set(f->dead[i], FAT_FREE);
+	}
+	f->ndead = 0;
 
-  	return -1;
+	//Clusters novos de uma cópia com mapa que não chegaram ao mapa no disco
+	for (int i = 0; !ok && f->clustermap && i < f->blocks; i++)
+	{
+		if(fat_get(f->dmap[i].cluster) == FAT_FREE) unreserve_cluster(f->dmap[i].cluster);
+	}
+
+	return ok && journal_commit();
 }
 
-int write_fat(){
-	int sector = 0;
-	int fat_count = 2*FATCLUSTERS/CLUSTERSIZE;	// Multiplica por 2 pq a FATCLUSTERS está em short (bytes/2)
-
-  	// Carregar a FAT
-	char* buffer = (char *) fat;
-	for (int i = 0; i < fat_count; i++) {	
-		if(bl_write(i, &buffer[i*SECTORSIZE])){
-			sector++;
+//Copia size bytes para o buffer de escrita, a partir do byte at do buffer (no máximo
+//f->len, o que estende o arquivo). Sem data, copia zeros. O buffer vai para o disco
+//sempre que enche; com ele vazio, os clusters inteiros vão direto de data (menos
+//num arquivo comprimido, que é gravado em grupos inteiros).
+int buffer_write(open_file *f, char *data, long long size, int at)
+{
+	long long copied = 0;
+
+	while(copied < size)
+	{
+		//O buffer passa a ser o próprio trecho de data durante a gravação
+		if(f->len == 0 && data != NULL && size - copied >= cluster_size && !f->compressed)
+		{
+			char *own = f->conteudo;
+			int whole = (size - copied) / cluster_size * cluster_size;
+
+			f->conteudo = &data[copied];
+			f->len = whole;
+			f->dirty_from = 0;
+			int ok = flush_write(f, 0, size - copied - whole);
+			f->conteudo = own;
+			if(!ok){
+				f->len = 0;
+				return 0;
+			}
+			copied += whole;
+			continue;
+		}
+
+		int n = WRITEBATCH * cluster_size - at;
+		if(n > size - copied) n = size - copied;
+
+		if(data != NULL){
+			memcpy(&f->conteudo[at], &data[copied], n);
 		}else{
-			return 0;
+			memset(&f->conteudo[at], 0, n);
 		}
-		  	}
+		if(at < f->dirty_from) f->dirty_from = at;
+		at += n;
+		copied += n;
+		if(at > f->len) f->len = at;
 
+		if(f->len == WRITEBATCH * cluster_size)
+		{
+			if(!flush_write(f, 0, size - copied)) return 0;
+			at = 0;
+		}
+	}
 
 	return 1;
 }
 
-int write_dir(){
-	char* buffer = (char *) dir;
-	int fat_count = 2*FATCLUSTERS/CLUSTERSIZE;
-	return bl_write(fat_count, buffer);
-	
-}
-
-void clean_write_buffer(){
-	
-	int size = strlen(writeBuff);
+//Escreve size bytes na posição offset do arquivo. O trecho que já está no disco é
+//reescrito no lugar, setor por setor (setores parciais são lidos, alterados e gravados);
+//o que cai no fim do arquivo passa pelo buffer de escrita. Uma posição além do fim é
+//alcançada preenchendo o intervalo com zeros. Num arquivo comprimido, o trecho que
+//já está no disco é reescrito grupo por grupo; num arquivo com deduplicação, cluster
+//por cluster.
+int write_at(open_file *f, char *buffer, int size, long long offset)
+{
+	long long end = file_end(f);
+	long long new_end = offset + size > end ? offset + size : end;
 
-	for (int i = 0; i < size ; i++)
+	//Checando se cabe em disco: clusters que o arquivo vai precisar além dos que
+	//ele já tem e da reserva contígua
+	long long needed = (new_end + cluster_size - 1) / cluster_size - f->blocks;
+	if(!f->compressed && needed - f->ext_left > free_clusters)
 	{
-		writeBuff[i] = '\0';
+		printf("Erro: Não há espaço o suficiente em disco\n");
+		return 0;
 	}
-}
 
+	if(offset > end && !buffer_write(f, NULL, offset - end, f->len)){
+		return 0;
+	}
 
-//void print_dir() {
-//	for (int i = 0; i < DIRENTRIES; i++){
-//    	printf("%d: %d %d %d\n", i, dir[i].first_block, dir[i].used, dir[i].size);
-//	}
-//}
-//
+	//Trecho anterior ao buffer: clusters do arquivo já gravados
+	long long buf_start = (long long) f->buf_lcn * cluster_size;
+	int done = 0;
+	char sector[SECTORSIZE];
 
-int create_file(char* file_name) {
-	//Operação apenas possível em disco formatado
-	if(!formatado){
-		printf("Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
+	if(f->compressed && (done = write_groups(f, buffer, size, offset, buf_start)) == -1){
+		return 0;
+	}
+	if(f->dedup && (done = write_dedup(f, buffer, size, offset, buf_start)) == -1){
 		return 0;
 	}
 
-	//Checando o tamanho do nome do arquivo
-	if(strlen(file_name) > 24)
+	if(!f->compressed && !f->dedup && offset < buf_start && (f->clustermap || f->shared_from < f->blocks)){
+		long long last = offset + size < buf_start ? offset + size : buf_start;
+		if(!own_clusters(f, offset / cluster_size, (last - 1) / cluster_size)) return 0;
+	}
+
+	//Os clusters já são do arquivo: a gravação no lugar não mexe nos metadados
+	int ok = 1;
+	alloc_unlock();
+	while(ok && done < size && offset + done < buf_start)
 	{
-		printf("Erro: Nome do arquivo deve conter apenas 24 caracteres\n");
+		long long pos = offset + done;
+		int in = pos % cluster_size;	//Posição dentro do cluster
+		int run;
+		int block = lcn_to_cluster(f, pos / cluster_size, &run);
+		if(block == -1){
+			ok = 0;
+			break;
+		}
+
+		int first = block * cluster_sectors + in / SECTORSIZE;
+		int n = SECTORSIZE - in % SECTORSIZE;
+		if(n > size - done) n = size - done;
+
+		if(n == SECTORSIZE)
+		{
+			//Setores inteiros e contíguos no disco são gravados direto do buffer de quem chamou
+			long long count = (size - done) / SECTORSIZE;
+			if(count > (long long) run * cluster_sectors - in / SECTORSIZE) count = (long long) run * cluster_sectors - in / SECTORSIZE;
+			if(count > (buf_start - pos) / SECTORSIZE) count = (buf_start - pos) / SECTORSIZE;
+			ok = write_sectors(first, count, &buffer[done]);
+			n = count * SECTORSIZE;
+		}
+		else
+		{
+			ok = read_sectors(first, 1, sector);
+			memcpy(&sector[in % SECTORSIZE], &buffer[done], n);
+			ok = ok && write_sectors(first, 1, sector);
+		}
+		done += n;
+
+		//A janela de leitura pode ter uma cópia antiga destes clusters
+		f->win_len = 0;
+	}
+	alloc_lock();
+	if(!ok) return 0;
+
+	if(done < size && !buffer_write(f, &buffer[done], size - done, offset + done - buf_start)){
 		return 0;
 	}
-	
-	
-	//checagem de nome repetido
-	
-	for(int i = 0; i < DIRENTRIES; i++){
-		if(dir[i].used){
-		
-			if(!strcmp(dir[i].name, file_name)){
-				//nome de arquivo igual causa erro
-				printf("Erro: Já existe um arquivo com esse nome.\n");
-				return 0;
+
+	return size;
+}
+
+
+//Lê até size bytes da posição offset do arquivo. Os dados passam por uma janela de
+//clusters em memória; leituras que continuam do fim da janela dobram a leitura
+//antecipada até READAHEAD, enquanto um salto para outra posição volta a ler um
+//cluster por vez. Num descritor que também escreve, o fim do arquivo que está no
+//buffer de escrita é copiado dele. Num arquivo comprimido, a janela guarda um
+//grupo inteiro, descomprimido.
+int read_at(open_file *f, char *buffer, int size, long long offset)
+{
+	int bytes_lidos = 0;
+	long long end = file_end(f);
+
+	if (offset >= end || size <= 0) {
+		return 0;
+	}
+	int bytes_para_ler = end - offset < size ? end - offset : size;
+
+	// O trecho que ainda está no buffer de escrita é copiado dele; o resto vem do disco
+	int total = bytes_para_ler;
+	long long disk_end = f->mode == FS_R ? end : (long long) f->buf_lcn * cluster_size;
+	if (offset + bytes_para_ler > disk_end) {
+		long long from = offset > disk_end ? offset : disk_end;
+		memcpy(&buffer[from - offset], &f->conteudo[from - disk_end], offset + bytes_para_ler - from);
+		bytes_para_ler = from - offset;
+	}
+
+	if (f->compressed) {
+		while (bytes_lidos < bytes_para_ler) {
+			long long pos = offset + bytes_lidos;
+
+			if (pos < f->win_start || pos >= f->win_start + f->win_len) {
+				int k = pos / GROUP_SIZE;
+				f->win_len = 0;
+				int length = load_group(f, k, f->janela);
+				if (length == -1) {
+					return -1;
+				}
+				f->win_start = (long long) k * GROUP_SIZE;
+				f->win_len = length;
+			}
+
+			int n = f->win_start + f->win_len - pos;
+			if (n > bytes_para_ler - bytes_lidos) {
+				n = bytes_para_ler - bytes_lidos;
 			}
+			memcpy(&buffer[bytes_lidos], &f->janela[pos - f->win_start], n);
+			bytes_lidos += n;
 		}
+		return total;
 	}
 
-	//Nova entrada no dir
-  	dir_entry new;
-  	new.used = 1;
-  	strcpy(new.name, file_name);
-  	new.first_block = find_first_empty_fat_index(0);
-  	new.size = 0; 
+	// Com a imagem mapeada os dados são copiados direto dela, sem passar pela janela
+	if (mapped) {
+		while (bytes_lidos < bytes_para_ler) {
+			long long pos = offset + bytes_lidos;
+			int n = cluster_size - pos % cluster_size;
+			if (n > bytes_para_ler - bytes_lidos) {
+				n = bytes_para_ler - bytes_lidos;
+			}
 
-	//Checagem se é possível adicionar mais arquivos 
-	int new_dir_index = find_first_empty_dir();
-	if(new_dir_index == -1)
-	{
-		printf("Erro: Não é possível criar mais arquivos\n");
+			int block = lcn_to_cluster(f, pos / cluster_size, NULL);
+			if (block == -1) {
+				return -1;
+			}
+			if (!bl_map_read(block * cluster_sectors, pos % cluster_size, &buffer[bytes_lidos], n)) {
+				return -1;
+			}
+			bytes_lidos += n;
+		}
+		return total;
+	}
+
+	while (bytes_lidos < bytes_para_ler) {
+		long long pos = offset + bytes_lidos;
+		int restante = bytes_para_ler - bytes_lidos;
+		long long win_end = f->win_start + f->win_len;
+
+		// Ainda há dados na janela
+		if (pos >= f->win_start && pos < win_end) {
+			int n = win_end - pos < restante ? win_end - pos : restante;
+			memcpy(&buffer[bytes_lidos], &f->janela[pos - f->win_start], n);
+			bytes_lidos += n;
+			continue;
+		}
+
+		// Leitura fora da sequência: a leitura antecipada recomeça
+		if (pos != win_end) {
+			f->ra = 1;
+		}
+
+		// Pedidos de clusters inteiros são lidos direto no buffer de quem chamou
+		if (pos % cluster_size == 0 && restante >= cluster_size) {
+			int clusters = restante / cluster_size;
+			if (!read_chain(f, pos / cluster_size, &buffer[bytes_lidos], clusters)) {
+				return -1;
+			}
+			bytes_lidos += clusters * cluster_size;
+			f->win_start = pos + (long long) clusters * cluster_size;
+			f->win_len = 0;
+			continue;
+		}
+
+		// Nova janela, a partir do cluster da posição pedida
+		int win_lcn = pos / cluster_size;
+		long long restantes_arquivo = (disk_end - (long long) win_lcn * cluster_size + cluster_size - 1) / cluster_size;
+		int clusters = f->ra < restantes_arquivo ? f->ra : restantes_arquivo;
+		if (!read_chain(f, win_lcn, f->janela, clusters)) {
+			return -1;
+		}
+		f->win_start = (long long) win_lcn * cluster_size;
+		f->win_len = clusters * cluster_size;
+		if (f->win_len > disk_end - f->win_start) {
+			f->win_len = disk_end - f->win_start;
+		}
+		if (f->ra < READAHEAD) {
+			f->ra *= 2;
+		}
+	}
+
+	return total;
+}
+
+
+//Prepara um descritor recém-aberto: aloca a janela de leitura e o buffer de escrita
+//conforme o modo e monta o mapa do arquivo. Nos modos de escrita, o buffer começa
+//no último cluster incompleto do arquivo, cujos setores usados são lidos do disco.
+//Num arquivo comprimido, o índice de grupos é lido, a janela (um grupo) serve a todos
+//os modos e o buffer começa no último grupo incompleto, descomprimido. Num arquivo com
+//deduplicação ou numa cópia com mapa, o mapa de trechos é montado a partir do mapa de
+//clusters.
+int setup_file(open_file *f)
+{
+	long long size = ENTRY(f->slot).size;
+
+	f->size = size;
+
+	f->compressed = (ENTRY(f->slot).flags & DIR_COMPRESSED) != 0;
+	f->dedup = (ENTRY(f->slot).flags & DIR_DEDUP) != 0;
+	f->clustermap = (ENTRY(f->slot).flags & DIR_CLUSTERMAP) != 0;
+	if (f->compressed) {
+		f->janela = malloc(GROUP_SIZE);
+		f->zbuf = malloc(GROUP_SIZE);
+	} else if (f->dedup) {
+		f->janela = malloc(READAHEAD * cluster_size);
+		f->zbuf = malloc(cluster_size);
+	} else if (f->mode == FS_R || f->mode == FS_RW) {
+		f->janela = malloc(READAHEAD * cluster_size);
+	}
+	if (f->mode != FS_R) {
+		f->conteudo = malloc(WRITEBATCH * cluster_size);
+	}
+	if ((f->mode != FS_W && f->mode != FS_A && f->janela == NULL) ||
+	    (f->mode != FS_R && f->conteudo == NULL) ||
+	    ((f->compressed || f->dedup) && (f->janela == NULL || f->zbuf == NULL))) {
+		printf("Erro: Memória insuficiente para abrir o arquivo\n");
+		return 0;
+	}
+
+	if (f->dedup || f->clustermap) {
+		if ((f->dedup && !dedup_prepare()) || (f->blocks = read_dmap(f->slot, &f->dmap)) == -1) {
+			return 0;
+		}
+		f->dmap_cap = f->blocks + 1;
+		f->last_block = f->blocks > 0 ? f->dmap[f->blocks - 1].cluster : (int) ENTRY(f->slot).first_block;
+		if (!dedup_map(f)) {
+			return 0;
+		}
+	} else {
+		if (!build_map(f)) {
+			return 0;
+		}
+		extent *last = &f->map[f->map_len - 1];
+		f->blocks = last->lcn + last->len;
+		f->last_block = last->block + last->len - 1;
+	}
+	if (f->compressed && !load_groups(f)) {
 		return 0;
 	}
 
-  	dir[new_dir_index] = new;
+	if (f->mode != FS_R) {
+		f->buf_lcn = size / cluster_size;
+		f->len = size % cluster_size;
+		if (f->compressed) {
+			f->buf_lcn = size / GROUP_SIZE * WRITEBATCH;
+			f->len = size % GROUP_SIZE;
+		}
+		f->dirty_from = f->len;
+
+		//Primeiro cluster compartilhado com outra cópia do arquivo
+		f->shared_from = NOT_SHARED;
+		if (!share_ready && !build_share_map()) {
+			return 0;
+		}
+		for (int lcn = 0; share_len > 0 && !f->dedup && !f->clustermap && lcn < f->blocks; lcn++) {
+			if (share_refs(lcn_to_cluster(f, lcn, NULL)) > 1) {
+				f->shared_from = lcn;
+				break;
+			}
+		}
+		if (f->compressed) {
+			if (f->len > 0 && load_group(f, f->ngroups - 1, f->conteudo) != f->len) {
+				return 0;
+			}
+		} else if (f->len > 0 && !read_sectors(lcn_to_cluster(f, f->buf_lcn, NULL) * cluster_sectors,
+		                                       (f->len + SECTORSIZE - 1) / SECTORSIZE, f->conteudo)) {
+			return 0;
+		}
+	}
+	if (f->mode == FS_A) {
+		f->pos = size;
+	}
+
+	return 1;
+}
+
 
-	fat[new.first_block] = 2;
+//Libera os buffers de um descritor
+void release_file(open_file *f)
+{
+	free(f->conteudo);
+	free(f->janela);
+	free(f->map);
+	free(f->groups);
+	free(f->zbuf);
+	free(f->dmap);
+	free(f->dead);
+	f->conteudo = NULL;
+	f->janela = NULL;
+	f->map = NULL;
+	f->groups = NULL;
+	f->zbuf = NULL;
+	f->dmap = NULL;
+	f->dead = NULL;
+}
 
-	if(write_fat() && write_dir()){
-		return new_dir_index;
+
+//Ajusta a geometria da imagem (largura da FAT, setores por cluster e entradas da FAT)
+//e refaz as estruturas em memória que dependem dela. Com map, a FAT é mapeada de
+//forma privada (fat_mapped); senão fica num buffer, lido ou montado por quem chama.
+//Devolve 0 se a imagem for pequena demais ou faltar memória.
+int set_geometry(int bits, int sectors_per_cluster, int entries, int map)
+{
+	if(fat_mapped){
+		bl_unmap(fat, fat_sectors);
 	}else{
-		return -1;
+		free(fat);
+	}
+	free(fat_dirty);
+	free(free_map);
+	free(journal_fats);
+	free(journal_fat_mark);
+	free(freed);
+	fat = NULL;
+	fat_mapped = 0;
+	journal_nfat = 0;
+	nfreed = 0;
+
+	fat_bits = bits;
+	cluster_sectors = sectors_per_cluster;
+	cluster_size = sectors_per_cluster * SECTORSIZE;
+	fat_entries = entries;
+	fat_per_sector = SECTORSIZE / (bits / 8);
+	fat_sectors = (entries + fat_per_sector - 1) / fat_per_sector;
+	dir_start = 1 + (fat_sectors + cluster_sectors - 1) / cluster_sectors;
+	journal_start = (dir_start + 1) * cluster_sectors;
+	journal_limit = bl_size() / JOURNALSHARE;
+	if(journal_limit < JOURNALMIN) journal_limit = JOURNALMIN;
+	if(journal_limit > JOURNALMAX) journal_limit = JOURNALMAX;
+	journal_group = journal_limit / 2 < JOURNALGROUP ? journal_limit / 2 : JOURNALGROUP;
+	journal_group_max = 2 * journal_group + 1;
+	journal_sectors = journal_limit + journal_group_max;
+	FatDirSize = dir_start + 1 + (journal_sectors + cluster_sectors - 1) / cluster_sectors;
+	dir_per_cluster = cluster_size / sizeof(dir_entry);
+	data_clusters = bl_size() / cluster_sectors < entries ? bl_size() / cluster_sectors : entries;
+
+	if(FatDirSize >= data_clusters) return 0;
+
+	if(map && (fat = bl_map_private(cluster_sectors, fat_sectors)) != NULL){
+		fat_mapped = 1;
+	}else{
+		fat = malloc((size_t) fat_sectors * SECTORSIZE);
+	}
+	fat_dirty = calloc(fat_sectors, 1);
+	free_map = calloc(entries / 64 + 1, sizeof(unsigned long long));
+	journal_fats = malloc((size_t) entries * sizeof(int));
+	journal_fat_mark = calloc(entries / 64 + 1, sizeof(unsigned long long));
+	freed = malloc((size_t) entries * sizeof(int));
+
+	if(fat == NULL || fat_dirty == NULL || free_map == NULL || journal_fats == NULL || journal_fat_mark == NULL ||
+	   freed == NULL){
+		printf("Erro: Memória insuficiente para a FAT\n");
+		return 0;
 	}
+
+	return 1;
 }
 
 
@@ -203,66 +3778,175 @@ int create_file(char* file_name) {
 /* Inicia o sistema de arquivos e suas estruturas internas. Esta função é automaticamente chamada pelo interpretador de comandos no
 início do sistema. Esta função deve carregar dados do disco para restaurar um sistema já em uso 
 e é um bom momento para verificar se o disco está formatado.*/
-int fs_init() {
-	int fat_count = 2*FATCLUSTERS/CLUSTERSIZE;	// Multiplica por 2 pq a FATCLUSTERS está em short (bytes/2)
+//Monta o sistema de arquivos da imagem (fs_init)
+int mount_image() {
+	superblock sb;
+
+	// Com a imagem mapeada, os dados dos arquivos são lidos direto do mapeamento
+	mapped = bl_map(0) != NULL;
+
+	// Checar se ta formatado: o superbloco dá a geometria da imagem. Numa imagem
+	// desmontada corretamente, a FAT é mapeada de forma privada (as páginas são
+	// lidas quando usadas)
+	int ok = read_superblock(&sb);
+	int clean = ok && sb.clean && sb.sectors == bl_size();
+	if (!ok || !set_geometry(sb.fat_bits, sb.cluster_sectors, sb.fat_entries, clean) ||
+	    sb.fat_sectors != fat_sectors || sb.dir_start != dir_start || sb.journal_start != journal_start ||
+	    sb.journal_sectors != journal_sectors) {
+		printf("Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
+		return 1;
+	}
 
-  	// Carregar a FAT
-	char* buffer = (char *) fat;
-	for (int i = 0; i < fat_count; i++) {	// Puxa os primeiros fat_count setores, lendo a FAT guardada no disco
-		bl_read(i, &buffer[i*SECTORSIZE]);
-  	}
+	// Carregar a FAT, que começa no cluster 1. Sem ela, nada do resto pode ser lido
+	if (!fat_mapped && !read_sectors(cluster_sectors, fat_sectors, fat)) {
+		printf("Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
+		return 1;
+	}
 
-	// Carregar o diretório
-	buffer = (char*)dir;
-	bl_read(fat_count, buffer);
+	if (clean) {
+		// O mapa de livres fica para a primeira alocação; só o diretório é lido
+		journal_seq = sb.journal_seq;
+		journal_pos = 1;
+		sb_clean = 1;
 
+		if (!load_dir()) {
+			release_dir();
+			printf("Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
+			return 1;
+		}
+		free_clusters = sb.free_clusters;
+		free_map_ready = 0;
+		__atomic_store_n(&share_len, sb.shared_clusters, __ATOMIC_RELAXED);
+		share_ready = share_len == 0;
+		dedup_clear();
+		dedup_block = sb.dedup_block;
+		dedup_ready = dedup_block == 0;
+		dedup_dirty = 0;
+		if (share_cap > 0) {
+			memset(share_key, -1, share_cap * sizeof(int));
+		}
+	} else {
+		// Checar se os índices reservados estão corretos
+		for (int i = 0; i < FatDirSize; i++) {
+			unsigned int reserved = i < dir_start ? FAT_RESERVED : JOURNALMARK;
+			if (i != dir_start && fat_get(i) != reserved) {
+				printf("Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
+				return 1;
+			}
+		}
 
-	// Checar se ta formatado
-	for (int i = 0; i < fat_count; i++) {	
-		// Checar se os arquivos estão com índices corretos
-	        if (fat[i] != 3) {
-    	        printf("Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
-    	        return 1;
-    	    }
-  	}
+		//Refazendo o que estiver no journal e carregando a cadeia do diretório,
+		//que começa logo depois da FAT
+		if (!replay_journal()) {
+			release_dir();
+			printf("Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
+			return 1;
+		}
 
-	//Checando índice do diretório
-  	if (fat[fat_count] != 4) {
-  	    printf("Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
-  	    return 1;
-  	}
+		build_free_map();
+		build_share_map();
+		dedup_rebuild();
+	}
+
+	build_dir_index();
   	
     formatado = 1;
 	return 1;
 }
 
+int fs_init() {
+	STATS_OP(ST_FS_INIT);
+	dir_lock();
+	alloc_lock();
+	int ok = mount_image();
+	alloc_unlock();
+	dir_unlock();
+	return ok;
+}
+
 /* Inicia o dispositivo de disco para uso, iniciando e 
 escrevendo as estruturas de dados necessárias */
-//Basicamente remove todas as entradas no diretório e reseta a FAT
+//Reformata com a geometria atual (ou a padrão, num disco não formatado)
 int fs_format() {
+	STATS_OP(ST_FS_FORMAT);
+	dir_lock();
+	alloc_lock();
+	int ok = formatado ? format_image(fat_bits, cluster_size) : format_image(DEFAULT_FAT_BITS, DEFAULT_CLUSTER_SIZE);
+	alloc_unlock();
+	dir_unlock();
+	return ok;
+}
+
+int fs_format_geometry(int fat_width, int cluster_bytes) {
+	STATS_OP(ST_FS_FORMAT);
+	dir_lock();
+	alloc_lock();
+	int ok = format_image(fat_width, cluster_bytes);
+	alloc_unlock();
+	dir_unlock();
+	return ok;
+}
+
+//Formata com entradas da FAT de fat_width bits (16 ou 32) e clusters de cluster_bytes
+//bytes (uma potência de 2 entre SECTORSIZE e 16 setores). A FAT de 16 bits endereça
+//no máximo FAT16_MAX clusters; o resto de uma imagem maior não é usado.
+//Basicamente remove todas as entradas no diretório e reseta a FAT
+int format_image(int fat_width, int cluster_bytes) {
 
-	//Limpando todo o vetor de Dir
-	for (int i = 0; i < DIRENTRIES; i++){
-    	//strcpy(dir[i].name, NULL);
-		dir[i].first_block = 0;
-		dir[i].used = 0;
-		dir[i].size = 0;
+	if((fat_width != 16 && fat_width != 32) || cluster_bytes < SECTORSIZE || cluster_bytes > MAX_CLUSTER_SIZE ||
+	   (cluster_bytes & (cluster_bytes - 1)) != 0){
+		printf("Erro: Geometria inválida (FAT de 16 ou 32 bits, clusters de %d a %d bytes)\n", SECTORSIZE, MAX_CLUSTER_SIZE);
+		return 0;
 	}
-	
-	//formatar a fat
-	for (int i = 0; i < 32; i++){
-    	fat[i] = 3;
+
+	//Descritores abertos deixam de valer
+	for (int i = 0; i < MAXOPEN; i++){
+		release_file(&files[i]);
+		files[i].used = 0;
+		file_taken[i] = 0;
 	}
 
-	//índice do diretório
-	fat[32] = 4;
+	//A nova geração do journal continua a numeração da anterior, para que
+	//blocos antigos que restem na região não sejam confundidos com novos
+	superblock old;
+	if(read_superblock(&old) && old.journal_seq > journal_seq){
+		journal_seq = old.journal_seq;
+	}
+
+	//O que estava no grupo do journal deixa de valer
+	journal_clear();
+	release_dir();
+	formatado = 0;
+
+	int sectors_per_cluster = cluster_bytes / SECTORSIZE;
+	int max = fat_width == 16 ? FAT16_MAX : FAT32_MAX;
+	int entries = bl_size() / sectors_per_cluster < max ? bl_size() / sectors_per_cluster : max;
+
+	if(!set_geometry(fat_width, sectors_per_cluster, entries, 0)){
+		printf("Erro: Imagem pequena demais para o sistema de arquivos\n");
+		return 0;
+	}
 
-	//índices mostrando que o setor está livre 
-	for (int i = 33; i < FATCLUSTERS; i++){
-    	fat[i] = 1;
+	//O diretório volta a ter um único cluster, com todas as entradas livres
+	if(!add_dir_sector(dir_start, 0)){
+		return 0;
+	}
+	
+	//formatar a fat: superbloco e FAT reservados, diretório, journal e o resto livre
+	memset(fat, 0, (size_t) fat_sectors * SECTORSIZE);
+	for (int i = 0; i < FatDirSize; i++){
+		fat_put(i, i < dir_start ? FAT_RESERVED : i == dir_start ? DIREND : JOURNALMARK);
 	}
+
+	mark_all_dirty();
+	build_free_map();
+	build_share_map();
+	dedup_clear();
+	dedup_block = 0;
+	dedup_ready = 1;
+	dedup_dirty = 0;
 	
-	if(write_dir() && write_fat()){
+	if(build_dir_index() && write_dir() && write_fat() && journal_reset() && write_superblock(0)){
 		formatado=1;
 		return 1;
 	}else{
@@ -273,426 +3957,761 @@ int fs_format() {
 }
 
 
-//Retorna o espaço livre no dispositivo em bytes
-int fs_free() {
+//Retorna o espaço livre no dispositivo em bytes.
+//O contador de clusters livres é mantido a cada alocação e liberação.
+long long fs_free() {
+	STATS_OP(ST_FS_FREE);
+	return (long long) __atomic_load_n(&free_clusters, __ATOMIC_RELAXED) * cluster_size;
+}
+
+
+//Clusters que só o arquivo slot usa e que a remoção dele devolveria. Num arquivo com
+//mapa, um cluster de dados que só fica livre depois de outro do mesmo mapa (ligado a
+//ele na FAT, ou repetido no mapa) não é contado. Chamada com alloc_mutex.
+long long private_clusters(int slot)
+{
+	if(!share_ready && !build_share_map()) return 0;
+
+	int flags = ENTRY(slot).flags;
+	long long n = chain_private(ENTRY(slot).first_block);
+	if(ENTRY(slot).index_block != 0) n += chain_private(ENTRY(slot).index_block);
+
+	dmap_entry *dmap;
+	int records;
+	if((flags & (DIR_DEDUP | DIR_CLUSTERMAP)) && (!(flags & DIR_DEDUP) || dedup_prepare()) &&
+	   (records = read_dmap(slot, &dmap)) != -1)
+	{
+		for (int i = 0; i < records; i++)
+		{
+			if(flags & DIR_DEDUP) n += dedup_refs(dmap[i].hash, dmap[i].cluster) == 1;
+			else n += chain_private(dmap[i].cluster);
+		}
+		free(dmap);
+	}
+
+	return n;
+}
+
+long long fs_reclaimable(char *file_name) {
+	STATS_OP(ST_FS_RECLAIMABLE);
+	if(!formatado){
+		printf("Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
+		return 0;
+	}
+
+	long long clusters = 0;
+	int k = name_lock(file_name);
+	int i = dir_lookup(file_name);
+	if(i != -1){
+		alloc_lock();
+		clusters = private_clusters(i);
+		alloc_unlock();
+	}
+	name_unlock(k);
+
+	return clusters * cluster_size;
+}
+
 
-	//33 = 32 setores da FAT + 1 setor do Dir
-	//Como não podem ser usados para escrever arquivos, subtraímos 
-	int max_size = (bl_size() - 33) * SECTORSIZE ;
+//Uma linha da listagem: a cópia de uma entrada usada do diretório e o que é contado
+//a partir da FAT
+typedef struct {
+  int slot;
+  dir_entry entry;
+  int extents;		//Trechos contíguos (-1 se não puderam ser contados)
+  int clusters;
+  int shared_from;	//Primeiro cluster compartilhado com outra cópia, ou -1
+} list_item;
+
+//Copia para items as entradas usadas entre as entries primeiras do diretório, com os
+//trechos da cadeia de cada uma. Com shares, procura também os clusters compartilhados
+//(a tabela deles precisa estar montada). Só lê memória, então pode ser feita sem trava
+//(ver fs_list); os trechos de um arquivo com deduplicação, que estão no mapa dele no
+//disco, ficam para dedup_extents. Devolve quantas entradas foram copiadas.
+int snapshot_dir(list_item *items, int entries, int shares)
+{
+	int n = 0;
+
+	for (int i = 0; i < entries; i++)
+	{
+		if(ENTRY(i).used != 1) continue;
+
+		list_item *item = &items[n++];
+		item->slot = i;
+		item->entry = ENTRY(i);
+		item->extents = count_extents(item->entry.first_block, &item->clusters);
+		item->shared_from = shares && !(item->entry.flags & (DIR_DEDUP | DIR_CLUSTERMAP)) ? first_shared(item->entry.first_block) : -1;
+	}
+
+	return n;
+}
 
-	//Somando o valor em bytes de todos os arquivos do sistema e subtraindo do total máximo
-	for (int i = 0 ; i < DIRENTRIES ; i++) {
+//Conta os trechos dos arquivos com deduplicação e das cópias com mapa da listagem,
+//lendo os mapas deles. Chamada com alloc_mutex; uma entrada que mudou desde a cópia
+//fica sem a contagem.
+void dedup_extents(list_item *items, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		dir_entry *e = &items[i].entry;
 
-		if(dir[i].used){
-			int actual_size = dir[i].size / SECTORSIZE; //divisao inteira do tamanho pelo setor
-			
-			//se a divisao nao for inteira ou o tamanho do arquivo for nulo, o arquivo ocupa um setor a mais.
-			if( (dir[i].size % SECTORSIZE) || actual_size == 0) actual_size++;
-			
-			max_size = max_size - (actual_size * SECTORSIZE);
-		 
+		if(!(e->flags & (DIR_DEDUP | DIR_CLUSTERMAP))) continue;
+		if(ENTRY(items[i].slot).used && ENTRY(items[i].slot).first_block == e->first_block && ENTRY(items[i].slot).size == e->size){
+			items[i].extents = count_dedup_extents(e->first_block, e->size);
+		}else{
+			items[i].extents = -1;
 		}
 	}
-  //printf("Função não implementada: fs_free\n");
-  return max_size;
 }
 
-
-//Lista os arquivos do diretório, 
-//colocando a saída formatada em buffer.
-int fs_list(char *buffer, int size) {
+//Coloca em buffer a listagem das n entradas de items, formatada
+void list_dir(char *buffer, int size, list_item *items, int n) {
 	//printf("Função não implementada: fs_list\n");
 	//buffer = NULL;
+
+	buffer[0]='\0';
+	char temp_buffer[256];
+	int len = 0;
 	
+	//Escrevendo as informações da listagem no buffer, com o número de trechos
+	//contíguos (extents) de cada arquivo como medida de fragmentação. Copiada sem
+	//trava, uma entrada pode estar pela metade: o nome é limitado ao campo.
+  	for (int i = 0 ; i < n ; i++) {
+		dir_entry *e = &items[i].entry;
+		int extents = items[i].extents;
+		int m;
+
+		//Num arquivo comprimido, a taxa de compressão em relação aos clusters ocupados;
+		//num deduplicado ou numa cópia com mapa, os trechos são os dos clusters de dados,
+		//não os do mapa
+		if(e->flags & (DIR_DEDUP | DIR_CLUSTERMAP)){
+			char *kind = (e->flags & DIR_DEDUP) ? "deduplicado" : "cópia com mapa de clusters";
+			if(extents < 0){
+				m = sprintf(temp_buffer, "%.24s\t\t%lld\t? extent(s)\t%s", e->name, e->size, kind);
+			}else{
+				m = sprintf(temp_buffer, "%.24s\t\t%lld\t%d extent(s)\t%s", e->name, e->size, extents, kind);
+			}
+		}else if(e->flags & DIR_COMPRESSED){
+			m = sprintf(temp_buffer, "%.24s\t\t%lld\t%d extent(s)\tcomprimido %.2f:1", e->name, e->size, extents,
+			            (double) e->size / ((double) items[i].clusters * cluster_size));
+		}else{
+			m = sprintf(temp_buffer, "%.24s\t\t%lld\t%d extent(s)", e->name, e->size, extents);
+		}
+
+		//Numa cópia feita por fs_clone, o custo de alterá-la. A cadeia de uma cópia
+		//comprimida só compartilha um fim, então escrever no cluster k copia os
+		//compartilhados até k; as outras passam a ter um mapa na primeira alteração,
+		//e só os clusters compartilhados reescritos são copiados
+		int from = items[i].shared_from;
+		if(from != -1 && (e->flags & DIR_COMPRESSED)){
+			m += sprintf(&temp_buffer[m], "\tcompartilha os clusters %d a %d: escrever no cluster k copia de %d a k",
+			             from, items[i].clusters - 1, from);
+		}else if(from != -1){
+			m += sprintf(&temp_buffer[m], "\tcompartilha clusters a partir do %d", from);
+		}
+		m += sprintf(&temp_buffer[m], "\n");
+		if(len + m >= size) break;
+		strcpy(&buffer[len], temp_buffer);
+		len += m;
+  	}
+
+	//printf("%s", buffer);
+}
+
+//As entradas são copiadas sem trava; se os metadados mudarem durante a cópia, ela é
+//refeita, e depois de READ_TRIES tentativas é feita com alloc_mutex (toda mudança no
+//diretório também tem alloc_mutex). Os mapas dos arquivos com deduplicação e das
+//cópias com mapa só são lidos depois, com a trava. Com clusters compartilhados, a cópia usa a tabela deles e
+//é feita com a trava.
+int fs_list(char *buffer, int size) {
+	STATS_OP(ST_FS_LIST);
 	//Operação apenas possível em disco formatado
 	if(!formatado){
 		printf("Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
 		return 0;
 	}
 
-	buffer[0]='\0';
-	char temp_buffer[150];
-	
-	//Escrevendo as informações da listagem no buffer
-  	for (int i = 0 ; i < DIRENTRIES ; i++) {
-    
-    	if(dir[i].used == 1) 
-    	{
-			sprintf(temp_buffer, "%s\t\t%d\n", dir[i].name, dir[i].size);
-			strcat(buffer, temp_buffer);
-      		//printf("%s\n", dir[i].name);
-    	} 
-  	}
+	list_item *items = NULL;
+	int n = -1;
 
-	//printf("%s", buffer);
+	for (int i = 0; i < READ_TRIES && __atomic_load_n(&share_len, __ATOMIC_RELAXED) == 0; i++) {
+		int entries = __atomic_load_n(&dir_entries, __ATOMIC_ACQUIRE);
+		list_item *grown = realloc(items, entries * sizeof(list_item));
+		if(grown == NULL){
+			break;
+		}
+		items = grown;
+
+		unsigned int seq = seq_read_begin(&alloc_mutex);
+		if(!(seq & 1)){
+			n = snapshot_dir(items, entries, 0);
+			if(!seq_read_retry(&alloc_mutex, seq)) break;
+			n = -1;
+		}
+		sched_yield();
+	}
+
+	int dedup = 0;
+	for (int i = 0; i < n; i++) {
+		dedup |= items[i].entry.flags & (DIR_DEDUP | DIR_CLUSTERMAP);
+	}
+	if(dedup){
+		alloc_lock();
+		dedup_extents(items, n);
+		alloc_unlock();
+	}else if(n == -1){
+		alloc_lock();
+		free(items);
+		items = malloc(dir_entries * sizeof(list_item));
+		if(items == NULL){
+			alloc_unlock();
+			printf("Erro: Memória insuficiente para listar o diretório\n");
+			return 0;
+		}
+		int shares = share_ready || build_share_map();
+		n = snapshot_dir(items, dir_entries, shares && share_len > 0);
+		dedup_extents(items, n);
+		alloc_unlock();
+	}
+
+	list_dir(buffer, size, items, n);
+	free(items);
 	return 1;
 }
 
 //Cria um novo arquivo com nome file_name e tamanho 0. 
 //Um erro deve ser gerado se o arquivo já existe.
 int fs_create(char* file_name) {
+	STATS_OP(ST_FS_CREATE);
+	int k = name_lock(file_name);
+	int ok = create_file(file_name, -1, 0) != -1;
+	name_unlock(k);
+	return ok;
+}
+
+
+//Remove o arquivo file_name. Chamada com o nome travado, e sem dir_mutex e alloc_mutex.
+int remove_file(char *file_name) {
+
 	
-	//Operação apenas possível em disco formatado
 	if(!formatado){
 		printf("Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
 		return 0;
 	}
 
-	//Checando o tamanho do nome do arquivo
-	if(strlen(file_name) > 24)
-	{
-		printf("Erro: Nome do arquivo deve conter apenas 24 caracteres\n");
-		return 0;
-	}
-	
-	
-	//checagem de nome repetido
-	
-	for(int i = 0; i < DIRENTRIES; i++){
-		if(dir[i].used){
-		
-			if(!strcmp(dir[i].name, file_name)){
-				//nome de arquivo igual causa erro
-				printf("Erro: Já existe um arquivo com esse nome.\n");
-				return 0;
-			}
+	int removed = 0;
+
+	//procurando o arquivo
+	int i = dir_lookup(file_name);
+	if(i != -1){
+
+		//Um arquivo aberto não pode ser removido
+		if(SLOT(i).open_count != 0){
+			printf("Erro: Arquivo está aberto!\n");
+			return 0;
+		}
+
+		//Setando removed para mostrar que houve um arquivo removido
+		removed = 1;
+		dir_lock();
+		alloc_lock();
+
+		//Os clusters de dados de um arquivo com deduplicação ou de uma cópia com mapa
+		//perdem uma referência
+		if((ENTRY(i).flags & DIR_DEDUP) && (!dedup_prepare() || !dedup_walk(i, -1, NULL))){
+			printf("Erro: Clusters do arquivo não puderam ser liberados\n");
+		}
+		if((ENTRY(i).flags & DIR_CLUSTERMAP) && !clustermap_walk(i, -1)){
+			printf("Erro: Clusters do arquivo não puderam ser liberados\n");
+		}
+
+		//Arquivo não é mais utilizado
+		dir_index_remove(i);
+		ENTRY(i).used = 0;
+		ENTRY(i).size = 0;
+		mark_dir_dirty(i);
+		dir_unlock();
+
+		//Removendo o arquivo da fat, a partir do primeiro bloco indexado (e o índice
+		//de grupos de um arquivo comprimido)
+		free_chain(ENTRY(i).first_block);
+		if(ENTRY(i).index_block != 0){
+			free_chain(ENTRY(i).index_block);
 		}
+		
+		journal_commit();
+		alloc_unlock();
 	}
 
-	//Nova entrada no dir
-  	dir_entry new;
-  	new.used = 1;
-  	strcpy(new.name, file_name);
-  	new.first_block = find_first_empty_fat_index(0);
-  	new.size = 0; 
+	if(!removed) printf("Erro: o arquivo passado como parâmetro não pode ser removido.\n");
 
-	//Checagem se é possível adicionar mais arquivos 
-	int new_dir_index = find_first_empty_dir();
-	if(new_dir_index == -1)
-	{
-		printf("Erro: Não é possível criar mais arquivos\n");
+	return removed;
+}
+
+int fs_remove(char *file_name) {
+	STATS_OP(ST_FS_REMOVE);
+	int k = name_lock(file_name);
+	int ok = remove_file(file_name);
+	name_unlock(k);
+	return ok;
+}
+
+
+//Cria file_name como cópia de source sem copiar dados: a nova entrada do diretório
+//aponta para os mesmos clusters, que só são duplicados quando uma das cópias for
+//alterada. Na primeira alteração, a cópia passa a listar seus clusters num mapa, e
+//cada cluster compartilhado reescrito é duplicado sozinho (ver own_clusters). Um
+//arquivo file_name que já exista é substituído. Chamada com os dois nomes travados.
+int clone_file(char *source, char *file_name) {
+	if(!formatado){
+		printf("Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
 		return 0;
 	}
 
-  	dir[new_dir_index] = new;
-	file_status[new_dir_index] = 'F';
+	int from = dir_lookup(source);
+	if(from == -1){
+		printf("Erro: Arquivo não existe!\n");
+		return 0;
+	}
 
-	fat[new.first_block] = 2;
+	//O fim de um arquivo aberto para escrita ainda pode estar no buffer
+	if(SLOT(from).open_count < 0){
+		printf("Erro: Arquivo está aberto para escrita!\n");
+		return 0;
+	}
 
-	if(write_fat() && write_dir()){
-		return 1;
-	}else{
+	int to = dir_lookup(file_name);
+	if(to != -1 && (to == from || SLOT(to).open_count != 0)){
+		printf("Erro: Arquivo está aberto!\n");
+		return 0;
+	}
+
+	alloc_lock();
+	int ok = (share_ready || build_share_map()) && (!(ENTRY(from).flags & DIR_DEDUP) || dedup_prepare());
+	alloc_unlock();
+	if(!ok || (to != -1 && !remove_file(file_name))){
 		return 0;
 	}
+
+	//A cadeia de uma cópia com deduplicação ou com mapa tem só o mapa, compartilhado;
+	//os clusters de dados ganham uma referência da cópia
+	to = create_file(file_name, from, 0);
+	if(to != -1 && (ENTRY(to).flags & (DIR_DEDUP | DIR_CLUSTERMAP))){
+		alloc_lock();
+		ok = (ENTRY(to).flags & DIR_DEDUP) ? dedup_walk(to, 1, NULL) : clustermap_walk(to, 1);
+		alloc_unlock();
+		if(!ok){
+			remove_file(file_name);
+			return 0;
+		}
+	}
+
+	return to != -1;
 }
 
+int fs_clone(char *source, char *file_name) {
+	STATS_OP(ST_FS_CLONE);
+	int k[2];
+	name_lock2(source, file_name, k);
+	int ok = clone_file(source, file_name);
+	name_unlock2(k);
+	return ok;
+}
 
-int fs_remove(char *file_name) {
 
-	
+//Estatísticas da deduplicação: clusters de dados guardados uma só vez, referências a
+//eles nos mapas dos arquivos e os bytes que as referências repetidas economizam
+int fs_get_dedup_stats(fs_dedup_stats *stats) {
+	STATS_OP(ST_FS_DEDUP_STATS);
 	if(!formatado){
 		printf("Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
 		return 0;
 	}
 
-	int removed = 0;
-	int i = 0;
-
-	while(i < DIRENTRIES){
-		
-		//procurando o arquivo
-		if(strcmp(file_name,dir[i].name) == 0 && dir[i].used){
-
-			//Setando removed para mostrar que houve um arquivo removido
-			removed = 1;
+	alloc_lock();
+	int ok = dedup_prepare();
+	if(ok){
+		stats->clusters = dedup_len;
+		stats->references = dedup_total;
+		stats->saved = (dedup_total - dedup_len) * cluster_size;
+	}
+	alloc_unlock();
+	return ok;
+}
 
-			//Arquivo não é mais utilizado
-			dir[i].used = 0;
-			dir[i].size = 0;
 
-			//Pegando o primeiro bloco indexado
-			int pos = dir[i].first_block;
-			int nextPos = fat[pos];
+//Grava no journal as alterações pendentes da FAT e do diretório, num único
+//bloco, e descarrega a cache de setores, caso esteja em modo write-back.
+//Os setores de origem são atualizados depois, no checkpoint.
+int fs_sync() {
+	STATS_OP(ST_FS_SYNC);
+	alloc_lock();
+	int ok = journal_flush();
+	alloc_unlock();
 
-			//Removendo o arquivo da fat
-			while(pos != 2){
+	return ok && bl_sync();
+}
 
-				fat[pos] = 1;
-				pos = nextPos;
-				nextPos = fat[pos];
-			}
-			
-			write_dir();
-			write_fat();
+//Desmonta o sistema de arquivos: fecha os arquivos abertos, leva o journal para
+//os setores de origem e marca o superbloco como limpo, com o contador de livres,
+//para que a próxima montagem leia apenas o superbloco.
+int fs_shutdown() {
+	STATS_OP(ST_FS_SHUTDOWN);
+	if(!formatado){
+		return bl_sync();
+	}
 
+	for (int i = 0; i < MAXOPEN; i++){
+		if(files[i].used) fs_close(i);
+	}
 
-			break;
-		}
-		//Precisa ir até o final devido a fat ser esparsa. E se fossemos compactar a fat, deveriamos compactar o disco e isso é uma operação mt custosa.
-		i++;
+	//O índice de conteúdo é gravado antes: sem ele, a imagem não fica limpa e a próxima
+	//montagem o refaz
+	alloc_lock();
+	int ok = dedup_save();
 
+	if(ok && !(sb_clean && journal_nfat == 0 && journal_ndir == 0)){
+		ok = journal_flush() && checkpoint() && write_superblock(1);
 	}
+	alloc_unlock();
 
-	if(!removed) printf("Erro: o arquivo passado como parâmetro não pode ser removido.\n");
-
-	return removed;
+	return ok && bl_sync();
 }
 
 
 // ------------ PARTE 2 -------------//
 
 
-int fs_open(char *file_name, int mode) {
-	//Operação apenas possível em disco formatado
-	if(!formatado){
-		printf("Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
+//Abre file_name no descritor livre fd, já reservado por fs_open. Chamada com o nome
+//travado.
+int open_at(int fd, char *file_name, int mode, int create_flags) {
+  	// Encontrar arquivo
+	int file_index = dir_lookup(file_name);
+
+	//O arquivo não pode ser alterado enquanto estiver aberto, nem lido enquanto
+	//estiver aberto para escrita (a janela de leitura ficaria desatualizada)
+	if (file_index != -1 && mode != FS_R && SLOT(file_index).open_count != 0) {
+		printf("Erro: Arquivo está aberto!\n");
+		return -1;
+	}
+	if (file_index != -1 && mode == FS_R && SLOT(file_index).open_count < 0) {
+		printf("Erro: Arquivo está aberto para escrita!\n");
 		return -1;
 	}
 
-	int file_index = -1;
-  	// Encontrar arquivo
-  	for (int i = 0 ; i < DIRENTRIES ; i++) {   
-    	if(dir[i].used == 0)
-    	  continue;
-    	  
-    	if (strcmp(file_name, dir[i].name) == 0) {
-    	  file_index = i;
-    	  break;
-    	}
-  	} 
-
-  	// Modo de leitura
-  	if (mode == FS_R) {
+  	// Modo de leitura e modo de leitura e escrita no lugar: o arquivo precisa existir
+  	if (mode == FS_R || mode == FS_RW) {
     	if (file_index == -1) {
       		printf("Erro: Arquivo não existe!\n");
       		return -1;
     	}
-		file_status[file_index] = 'R';
-		readBuff.file_id = -1;
-    
-  	// Modo de escrita
-  	} else {
+
+  	// Modo de escrita: o arquivo é truncado
+  	} else if (mode == FS_W) {
     	if (file_index != -1) {
-      		fs_remove(file_name);
+      		remove_file(file_name);
     	}
     	
-		file_index = create_file(file_name);
+		file_index = create_file(file_name, -1, create_flags);
     	
 		if (file_index == -1){
       		return -1;
 		}
-		
-		file_status[file_index] = 'W';
-  }
+
+  	// Modo de acréscimo: o arquivo é criado se não existir
+  	} else if (mode == FS_A) {
+		if (file_index == -1 && (file_index = create_file(file_name, -1, create_flags)) == -1) {
+			return -1;
+		}
+
+  	} else {
+		printf("Erro: Modo de abertura inválido\n");
+		return -1;
+  	}
+
+	open_file *f = &files[fd];
+	memset(f, 0, sizeof(open_file));
+	f->used = 1;
+	f->slot = file_index;
+	f->mode = mode;
+	f->ra = 1;
+	alloc_lock();
+	int ok = setup_file(f);
+	alloc_unlock();
+	if (!ok) {
+		release_file(f);
+		memset(f, 0, sizeof(open_file));
+		return -1;
+	}
+	SLOT(file_index).open_count = mode == FS_R ? SLOT(file_index).open_count + 1 : -1;
   
-  return file_index;
+  return fd;
 }
 
+int fs_open(char *file_name, int mode) {
+	STATS_OP(ST_FS_OPEN);
+	//Operação apenas possível em disco formatado
+	if(!formatado){
+		printf("Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
+		return -1;
+	}
+
+	//FS_Z e FS_D só valem para o arquivo criado na abertura (FS_W, ou FS_A de um
+	//arquivo novo), e não podem ser combinados
+	int create_flags = ((mode & FS_Z) ? DIR_COMPRESSED : 0) | ((mode & FS_D) ? DIR_DEDUP : 0);
+	mode &= ~(FS_Z | FS_D);
+	if ((create_flags && mode != FS_W && mode != FS_A) || create_flags == (DIR_COMPRESSED | DIR_DEDUP)) {
+		printf("Erro: Modo de abertura inválido\n");
+		return -1;
+	}
 
-int fs_close(int file)  {
-	//verifica o arquivo no diretorio
-	if(dir[file].used==0){
-		printf("Erro: Arquivo não existe!\n");
-		return 0;
+	//Reserva um descritor livre e fica com a trava dele. A trava pode estar com quem
+	//acabou de fechá-lo, ou com um get_file de um descritor já fechado.
+	int fd = -1;
+	for (int i = 0; i < MAXOPEN && fd == -1; i++) {
+		if (!__atomic_load_n(&file_taken[i], __ATOMIC_RELAXED) && !__atomic_exchange_n(&file_taken[i], 1, __ATOMIC_ACQUIRE)) {
+			fd = i;
+		}
 	}
-	//verificar se o arquivo em questao está aberto
-	if(file_status[file]=='F'){
+	if (fd == -1) {
+		printf("Erro: Arquivos abertos demais!\n");
+		return -1;
+	}
+	pthread_mutex_lock(&file_locks[fd]);
+
+	int k = name_lock(file_name);
+	int file = open_at(fd, file_name, mode, create_flags);
+	name_unlock(k);
+	if (file == -1) __atomic_store_n(&file_taken[fd], 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&file_locks[fd]);
+
+	return file;
+}
+
+//Devolve o descritor aberto file, já travado, ou NULL se ele não existir.
+//O descritor é liberado com put_file.
+open_file *get_file(int file)
+{
+	if(file < 0 || file >= MAXOPEN){
 		printf("Erro: Arquivo não está aberto!\n");
-		return 0;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&file_locks[file]);
+	if(!files[file].used){
+		pthread_mutex_unlock(&file_locks[file]);
+		printf("Erro: Arquivo não está aberto!\n");
+		return NULL;
+	}
+
+	return &files[file];
+}
+
+void put_file(open_file *f)
+{
+	pthread_mutex_unlock(&file_locks[f - files]);
+}
+
+//Fecha o descritor f. Chamada com o nome do arquivo travado.
+int close_file(open_file *f)
+{
+	int ok = 1;
+
+	//Grava o que restou no buffer de escrita, inclusive o último setor incompleto.
+	//Com a imagem mapeada, as escritas vão para o disco no fechamento.
+	if(f->mode != FS_R)
+	{
+		alloc_lock();
+		ok = finish_write(f) && (!mapped || bl_sync());
+		alloc_unlock();
 	}
 
-	//Ultima chamada para terminar de printar 
-	if(file_status[file] == 'W' && fs_write(NULL,-1,file) == 0)
+	//o descritor é liberado
+	SLOT(f->slot).open_count = f->mode == FS_R ? SLOT(f->slot).open_count - 1 : 0;
+	release_file(f);
+	f->used = 0;
+	__atomic_store_n(&file_taken[f - files], 0, __ATOMIC_RELEASE);
+
+	//Um arquivo recém-criado incompleto é descartado; um arquivo que já existia
+	//fica com o que foi possível gravar
+	if(!ok && f->mode == FS_W)
 	{
 		printf("Erro: arquivo não pode ser criado corretamente\n");
-		clean_write_buffer();
-		fs_remove(dir[file].name);
+		remove_file(ENTRY(f->slot).name);
+	}
+	else if(!ok)
+	{
+		printf("Erro: alterações no arquivo podem não ter sido gravadas\n");
+	}
+	
+	return ok;
+}
+
+int fs_close(int file)  {
+	STATS_OP(ST_FS_CLOSE);
+
+	//verificar se o arquivo em questao está aberto
+	open_file *f = get_file(file);
+	if(f == NULL){
 		return 0;
 	}
 
-	//se o arquivo existe no diretório e foi aberto, ele é marcado como fechado
-	file_status[file] = 'F';	
-  	//printf("Função não implementada: fs_close\n");
-	
-//	clean_write_buffer();
+	//O nome de um arquivo aberto não muda
+	int k = name_lock(ENTRY(f->slot).name);
+	int ok = close_file(f);
+	name_unlock(k);
+	put_file(f);
 
-	return 1;
+	return ok;
 }
 
 
 
-int fs_write(char *buffer, int size, int file) {
-	//printf("Função não implementada: fs_write\n");
-		
-	//Operação apenas possível em disco formatado
-	if(!formatado){
-		printf("Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
+
+//Move o cursor usado por fs_read e fs_write para a posição offset do arquivo.
+//Uma posição além do fim é permitida: a próxima escrita preenche o intervalo com zeros.
+int fs_seek(int file, long long offset) {
+	STATS_OP(ST_FS_SEEK);
+	open_file *f = get_file(file);
+	if(f == NULL){
 		return 0;
 	}
 
-	//Operação apenas possível em arquivo com capacidade de escrita 
-	if(file_status[file]!='W') 
+	if(offset < 0)
 	{
-		printf("Erro: Arquivo não possui capacidade de escrita\n");
+		printf("Erro: Posição inválida\n");
+		put_file(f);
 		return 0;
 	}
 
-	int writeBuffSize = strlen(writeBuff);
-
-	//Checando se cabe em disco 
-	if(writeBuffSize + size > fs_free())
-	{
-		printf("Erro: Não há espaço o suficiente em disco\n");
-		clean_write_buffer();
-		
+	f->pos = offset;
+	put_file(f);
+	return 1;
+}
 
+//Escreve size bytes na posição offset pelo descritor f, já travado. A alocação fica
+//travada durante a escrita, menos nas transferências de dados.
+int pwrite_file(open_file *f, char *buffer, int size, long long offset)
+{
+	//Operação apenas possível em disco formatado
+	if(!formatado){
+		printf("Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
 		return 0;
 	}
 
-	//Checando se cabe no buffer de escrita 
-	if(writeBuffSize + size > MAXFILE)
+	//Operação apenas possível em arquivo com capacidade de escrita 
+	if(f->mode == FS_R) 
 	{
-		printf("Erro: Tamanho máximo de arquivo excedido\n");
-		clean_write_buffer();
-		
-
+		printf("Erro: Arquivo não possui capacidade de escrita\n");
 		return 0;
 	}
 
-
-	// A chamada fs_close indica que os últimos bytes foram salvos no buffer de escrita mandando o size como -1. 
-	// Enquanto não for, apenas concatenamos o conteúdo a um buffer de escrita
-	// Essa prática foi escolhida devido a quantidade de bytes mandados pelas funções de copia (apenas 10). 
-	// Como o acesso a memória segundária é extremamente lento, com esse truque acessamos ele o menor número de vezes 
-	if(size >= 0)
+	//No modo de acréscimo toda escrita vai para o fim do arquivo
+	if(f->mode == FS_A)
 	{
-		strncat(writeBuff,buffer,size);
-		//puts(writeBuff);
-		return size;
+		offset = file_end(f);
 	}
 
-	writeBuff[writeBuffSize] = '\0';
-
-
-	//Caso o tamanho não caiba certinho em todos os setores, temos que levar isso em conta. 
-	// Como não temos a função de teto da math.h, caso o size tenha resto, adicionamos +1 (meio que um teto artificial)
-	int quebrado = (writeBuffSize % SECTORSIZE) != 0 ? 1 : 0;
-
-	int iterations = (writeBuffSize / SECTORSIZE) + quebrado;
-
-	int w_block = dir[file].first_block;
-
-	//Flag indicando última iteração 
-	int lastRide = 0;
-	for (int i = 0; i < iterations; i++) {
-
-		//Se for a última iteração temos que setar a fat com 2
-		if(i+1 == iterations) 
-		{
-			fat[w_block] = 2;
-			lastRide = 1;
-		}
-
-		
-
-		//pegando o próximo bloco livre. O parâmetro da função indica para desconsiderar que o bloco atual está livre, se não, 
-		// a função retornará sempre w_block já que sua posição na fat mudará apenas mais pra frente 
-		int new_block = find_first_empty_fat_index(w_block);
+	if(offset < 0)
+	{
+		printf("Erro: Posição inválida\n");
+		return 0;
+	}
 
-		if(!lastRide) 
-		{
-			//Atualizando apontador pro próximo setor com informações
-			fat[w_block] = new_block ;
-			
-		}
+	alloc_lock();
+	int written = write_at(f, buffer, size, offset);
+	alloc_unlock();
 
+	return written;
+}
 
-		bl_write(w_block, &writeBuff[i*SECTORSIZE]);
-		w_block = new_block;
+int fs_write(char *buffer, int size, int file) {
+	STATS_OP(ST_FS_WRITE);
+	open_file *f = get_file(file);
+	if(f == NULL){
+		return 0;
 	}
-		//bl_write(find_first_empty_fat_index(0),);
-
 
-	//Ajustando o tamanho do arquivo
-	dir[file].size += writeBuffSize;
+	int written = STATS_BYTES(pwrite_file(f, buffer, size, f->pos));
+	if(written > 0){
+		f->pos += written;
+	}
+	put_file(f);
 
-	clean_write_buffer();
+	return written;
+}
 
-	//Escrevendo as modificações
-	if(write_fat() && write_dir()){
-		return 1;
-	}else{
+//Escreve size bytes na posição offset do arquivo, sem mover o cursor.
+//Apenas os setores atingidos pela escrita são gravados.
+int fs_pwrite(char *buffer, int size, int file, long long offset) {
+	STATS_OP(ST_FS_PWRITE);
+	open_file *f = get_file(file);
+	if(f == NULL){
 		return 0;
 	}
-	
 
-	
-}
+	int written = STATS_BYTES(pwrite_file(f, buffer, size, offset));
+	put_file(f);
 
+	return written;
+}
 
-int fs_read(char *buffer, int size, int file) {
-    // printf("Função não implementada: fs_read\n");
-  // return -1;
-  // caso o arquivo n esteja senod usando
-  //
-  int bytes_lidos = 0;
 
+// Lê até size bytes da posição offset pelo descritor f, já travado. A leitura
+// usa apenas o mapa do descritor, sem travar os metadados.
+int pread_file(open_file *f, char *buffer, int size, long long offset) {
   if (!formatado) {
     printf(
         "Erro: o disco não está pronto para uso. É necessário formatá-lo.\n");
     return 0;
   }
 
-  if (!dir[file].used) {
-    printf("Arquivo informado não esta sendo utilizado");
+  if (f->mode != FS_R && f->mode != FS_RW) {
+    printf("Arquivo nao esta no modo de leitura.");
     return -1;
   }
 
-  if (file_status[file] != 'R') {
-    printf("Arquivo nao esta no modo de leitura.");
+  if (offset < 0) {
+    printf("Erro: Posição inválida\n");
     return -1;
   }
+  if (offset >= file_end(f)) {
+    return 0;
+  }
 
-  // Para a primeira chamada configurando todo o arquivo a ser lido;
- 
-  if (readBuff.file_id != file) {
-    readBuff.file_id = file;
-    readBuff.pos_read = 0;
-
-    // Aq lê o arq completo
-    // Pegando o primeiro bloco indexado
-    int pos = dir[file].first_block;
-    int nextPos = fat[pos];
+  return read_at(f, buffer, size, offset);
+}
 
-    // Lendo o arquivo completamente para a fat
-    readBuff.conteudo[0] = '\0';
-    for (int i = 0; pos != 2; i++) {
-      bl_read(pos, &readBuff.conteudo[i * SECTORSIZE]);
+int fs_read(char *buffer, int size, int file) {
+  STATS_OP(ST_FS_READ);
+  open_file *f = get_file(file);
+  if (f == NULL) {
+    return -1;
+  }
 
-      pos = nextPos;
-      nextPos = fat[pos];
-    }
+  int bytes_lidos = STATS_BYTES(pread_file(f, buffer, size, f->pos));
 
-	//puts(readBuff.conteudo);
-    
+  // No fim do arquivo o cursor fica onde está, para que uma escrita em FS_RW
+  // depois de ler tudo continue a partir do fim
+  if (bytes_lidos > 0) {
+    f->pos += bytes_lidos;
   }
+  put_file(f);
 
-  // passando o arquivo de size em size
-  if (dir[readBuff.file_id].size > readBuff.pos_read) {
+  return bytes_lidos;
+}
 
-    int bytes_para_ler = size;
-    if (dir[readBuff.file_id].size < readBuff.pos_read + size) {
-      bytes_para_ler = dir[readBuff.file_id].size - readBuff.pos_read;
-    }
+//Lê até size bytes da posição offset do arquivo, sem mover o cursor.
+//Devolve 0 se offset estiver no fim do arquivo ou além dele.
+int fs_pread(char *buffer, int size, int file, long long offset) {
+  STATS_OP(ST_FS_PREAD);
+  open_file *f = get_file(file);
+  if (f == NULL) {
+    return -1;
+  }
 
-    strncpy(buffer, &readBuff.conteudo[readBuff.pos_read], bytes_para_ler);
-    bytes_lidos = bytes_para_ler;
-    readBuff.pos_read += bytes_para_ler;
-    return bytes_lidos;
+  int bytes_lidos = STATS_BYTES(pread_file(f, buffer, size, offset));
+  put_file(f);
 
-  } else {
-    readBuff.pos_read = 0;
-    return 0;
-  }
+  return bytes_lidos;
 }
-
@@ -22,14 +22,49 @@
 
 #define FS_R 0
 #define FS_W 1
+#define FS_A 2
+#define FS_RW 3
+
+/* Combinado com FS_W ou FS_A (|), o arquivo criado na abertura é comprimido. */
+#define FS_Z 8
+
+/* Combinado com FS_W ou FS_A (|), os clusters do arquivo criado na abertura são
+ * deduplicados: clusters com o mesmo conteúdo são guardados uma só vez. */
+#define FS_D 16
+
+typedef struct {
+  long long clusters;     /* Clusters de dados deduplicados, guardados uma só vez */
+  long long references;   /* Clusters dos arquivos que apontam para eles */
+  long long saved;        /* Bytes economizados pelas referências repetidas */
+} fs_dedup_stats;
 
 int fs_init();
 int fs_format();
-int fs_free();
+int fs_format_geometry(int fat_bits, int cluster_size);
+long long fs_free();
+
+/* Bytes que voltam a ser livres se file_name for removido ou sobrescrito (FS_W):
+ * os dos clusters que só ele usa (pelo menos esses, num arquivo com mapa de
+ * clusters). 0 se o arquivo não existir. */
+long long fs_reclaimable(char *file_name);
 int fs_list(char *buffer, int size);
 int fs_create(char *file_name);
 int fs_remove(char *file_name);
+
+/* Cria file_name como cópia de source sem copiar dados. Na primeira alteração, a
+ * cópia passa a listar seus clusters num mapa: escrever num cluster compartilhado
+ * copia só esse cluster, e acrescentar ao fim não copia nada. Uma cópia comprimida
+ * continua compartilhando o fim da cadeia, e escrever no cluster k dela copia os
+ * compartilhados até k. fs_list mostra o que cada cópia ainda compartilha. */
+int fs_clone(char *source, char *file_name);
+
+int fs_get_dedup_stats(fs_dedup_stats *stats);
 int fs_open(char *file_name, int mode);
 int fs_close(int file);
 int fs_write(char *buffer, int size, int file);
 int fs_read(char *buffer, int size, int file);
+int fs_seek(int file, long long offset);
+int fs_pwrite(char *buffer, int size, int file, long long offset);
+int fs_pread(char *buffer, int size, int file, long long offset);
+int fs_sync();
+int fs_shutdown();
@@ -0,0 +1,185 @@
+/*
+ * RSFS - Really Simple File System
+ *
+ * Copyright © 2026 LabSO-ProjetoFinal contributors
+ *
+ * This file is part of RSFS.
+ *
+ * RSFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_HASHBITS 12        /* Posições guardadas para achar repetições */
+#define LZ_MAXOFFSET 65535    /* Maior distância de uma cópia */
+
+static unsigned int read32(const unsigned char *p) {
+  unsigned int v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static int lz_hash(unsigned int v) {
+  return (v * 2654435761u) >> (32 - LZ_HASHBITS);
+}
+
+/* Grava um tamanho estendido: bytes de 255 e o resto. */
+static unsigned char *put_length(unsigned char *op, int len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = len;
+  return op;
+}
+
+/* Grava uma sequência: lit_len literais e, se match_len > 0, a cópia de
+ * match_len bytes a offset bytes para trás. Devolve NULL se não couber. */
+static unsigned char *emit(unsigned char *op, unsigned char *end, const unsigned char *lit,
+                           int lit_len, int offset, int match_len) {
+  unsigned char *token = op;
+  int ml = match_len - LZ_MINMATCH;
+
+  if (end - op < 1 + lit_len / 255 + 1 + lit_len + 2 + (match_len ? ml / 255 + 1 : 0)) {
+    return NULL;
+  }
+
+  op++;
+  if (lit_len >= 15) {
+    op = put_length(op, lit_len - 15);
+  }
+  memcpy(op, lit, lit_len);
+  op += lit_len;
+  *token = (lit_len >= 15 ? 15 : lit_len) << 4;
+
+  if (match_len > 0) {
+    *op++ = offset & 255;
+    *op++ = offset >> 8;
+    if (ml >= 15) {
+      op = put_length(op, ml - 15);
+    }
+    *token |= ml >= 15 ? 15 : ml;
+  }
+  return op;
+}
+
+/* Comprime n bytes de src em dst, que tem cap bytes. Devolve o tamanho
+ * comprimido, ou 0 se não couber em cap. As repetições são achadas por uma
+ * tabela hash dos últimos 4 bytes lidos; sem achar nenhuma, o passo cresce
+ * para atravessar depressa dados que não comprimem. */
+int lz_compress(const char *src, int n, char *dst, int cap) {
+  const unsigned char *in = (const unsigned char *) src;
+  unsigned char *op = (unsigned char *) dst;
+  unsigned char *end = op + cap;
+  int table[1 << LZ_HASHBITS];
+  int ip = 0, anchor = 0;
+
+  memset(table, -1, sizeof(table));
+  while (ip + LZ_MINMATCH <= n) {
+    unsigned int v = read32(&in[ip]);
+    int h = lz_hash(v);
+    int ref = table[h];
+    int len;
+
+    table[h] = ip;
+    if (ref < 0 || ip - ref > LZ_MAXOFFSET || read32(&in[ref]) != v) {
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+
+    len = LZ_MINMATCH;
+    while (ip + len < n && in[ref + len] == in[ip + len]) {
+      len++;
+    }
+    if ((op = emit(op, end, &in[anchor], ip - anchor, ip - ref, len)) == NULL) {
+      return 0;
+    }
+    ip += len;
+    anchor = ip;
+  }
+
+  if ((op = emit(op, end, &in[anchor], n - anchor, 0, 0)) == NULL) {
+    return 0;
+  }
+  return op - (unsigned char *) dst;
+}
+
+/* Lê um tamanho estendido, somando-o a *len. Devolve 0 se faltar entrada. */
+static int get_length(const unsigned char *in, int n, int *ip, int *len) {
+  int b;
+
+  do {
+    if (*ip >= n) {
+      return 0;
+    }
+    b = in[(*ip)++];
+    *len += b;
+  } while (b == 255);
+  return 1;
+}
+
+/* Descomprime os n bytes de src em dst, que tem cap bytes. Devolve o
+ * tamanho descomprimido, ou -1 se os dados forem inválidos ou não couberem. */
+int lz_decompress(const char *src, int n, char *dst, int cap) {
+  const unsigned char *in = (const unsigned char *) src;
+  int ip = 0, op = 0;
+
+  while (ip < n) {
+    int token = in[ip++];
+    int lit = token >> 4;
+    int ml = token & 15;
+    int offset;
+
+    if (lit == 15 && !get_length(in, n, &ip, &lit)) {
+      return -1;
+    }
+    if (lit > n - ip || lit > cap - op) {
+      return -1;
+    }
+    memcpy(&dst[op], &in[ip], lit);
+    ip += lit;
+    op += lit;
+
+    if (ip == n) {
+      break;
+    }
+
+    if (n - ip < 2) {
+      return -1;
+    }
+    offset = in[ip] | in[ip + 1] << 8;
+    ip += 2;
+    if (ml == 15 && !get_length(in, n, &ip, &ml)) {
+      return -1;
+    }
+    ml += LZ_MINMATCH;
+    if (offset == 0 || offset > op || ml > cap - op) {
+      return -1;
+    }
+
+    /* Cópias que se sobrepõem repetem o trecho byte a byte */
+    if (offset >= ml) {
+      memcpy(&dst[op], &dst[op - offset], ml);
+    } else {
+      for (int i = 0; i < ml; i++) {
+        dst[op + i] = dst[op - offset + i];
+      }
+    }
+    op += ml;
+  }
+  return op;
+}
@@ -0,0 +1,34 @@
+/*
+ * RSFS - Really Simple File System
+ *
+ * Copyright © 2026 LabSO-ProjetoFinal contributors
+ *
+ * This file is part of RSFS.
+ *
+ * RSFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Compressão LZ77 de blocos independentes, no estilo do LZ4: cada sequência
+ * é um byte de controle (tamanho dos literais nos 4 bits altos, tamanho da
+ * cópia menos LZ_MINMATCH nos 4 baixos, estendidos com bytes de 255), os
+ * literais e a distância da cópia em 2 bytes. A última sequência só tem
+ * literais. */
+
+#define LZ_MINMATCH 4
+
+/* Espaço de saída que garante a compressão de n bytes, mesmo sem ganho. */
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+int lz_compress(const char *src, int n, char *dst, int cap);
+int lz_decompress(const char *src, int n, char *dst, int cap);
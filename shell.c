@@ -23,184 +23,279 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "disk.h"
 #include "fs.h"
+#include "stats.h"
 
 #define MAX_STR 256
 #define MAX_ARG 32
-#define COPY_BUFFER_SIZE 10
+#define COPY_BUFFER_SIZE (1024 * 1024)
+#define CACHE_SECTORS 256
+#define LIST_BUFFER_SIZE (4 * 1024 * 1024)
 
-void format();
+void format(int fat_bits, int cluster_kib);
 void list();
 void create(char *file);
 void fremove(char *file);
 void copy(char *file1, char *file2);
-void copyf(char *file1, char *file2);
+void copyf(char *file1, char *file2, int mode);
 void copyt(char *file1, char *file2);
-
-
-void explode()
-{
-    for(int i = 0 ; i < 55 ; i++) {
-
-      char str[20];
-      sprintf(str, "%d", i);
-
-      copyf("big",str);
-
-  }
-}
-
-void createFile()
-{
-
-  copyf("big","teste");
-}
-
-void nonSeq()
-{
-
-  format();
-
-
-  copyf("small","primeiro");
-  copyf("small","segundo");
-  fs_remove("primeiro");
-  copyf("big","terceiro");
-}
-
-
-void readAndWrite()
-{
-
-  format();
-
-
-  copyf("textoin.txt","texto");
-  copyt("texto","textoout.txt");
-}
+void cache();
+void dedupstats();
+int command(char *linha);
+int batch(char *script);
 
 int main(int argc, char **argv) {
   char *image;
   int size;
   char linha[MAX_STR];
-  char *args[MAX_ARG + 1];
-  char *token;
-  int i, tam;
+  char *script;
+  int opt, cache_sectors, cache_policy, flags, ok;
 
   size = -1;
-  if (argc >= 2 && argc <= 3) {
-    image = argv[1];
-    if (argc > 2) {
-      size = (atoi(argv[2]) * 1024 * 1024) / SECTORSIZE;
+  cache_sectors = CACHE_SECTORS;
+  cache_policy = BL_WRITE_THROUGH;
+  flags = 0;
+  script = NULL;
+  while ((opt = getopt(argc, argv, "b:c:mw")) != -1) {
+    switch (opt) {
+    case 'b':
+      script = optarg;
+      break;
+    case 'c':
+      cache_sectors = atoi(optarg);
+      break;
+    case 'm':
+      flags |= BL_MMAP;
+      break;
+    case 'w':
+      cache_policy = BL_WRITE_BACK;
+      break;
+    default:
+      argc = 0;
+    }
+  }
+
+  if (argc - optind >= 1 && argc - optind <= 2) {
+    image = argv[optind];
+    if (argc - optind > 1) {
+      size = (atoll(argv[optind + 1]) * 1024 * 1024) / SECTORSIZE;
     }
   } else {
-    printf("Uso: %s imagem [tamanho]\n", argv[0]);
+    printf("Uso: %s [-b script] [-c setores] [-w] [-m] imagem [tamanho]\n", argv[0]);
     printf("Onde: imagem é o arquivo contendo a imagem do disco.\n");
     printf("      tamanho (opcional) é o tamanho da imagem em MB.\n");
+    printf("      -c setores define o tamanho da cache de setores (padrão %d, 0 desliga).\n", CACHE_SECTORS);
+    printf("      -w usa a cache em modo write-back (padrão write-through).\n");
+    printf("      -m mapeia a imagem em memória (dispensa a cache).\n");
+    printf("      -b executa os comandos do arquivo script, com o tempo de cada um, e sai.\n");
     exit(0);
   }
 
-  if (!bl_init(image, size)) {
+  if (!bl_init(image, size, flags)) {
+    exit(0);
+  }
+  if (!bl_cache_init(cache_sectors, cache_policy)) {
     exit(0);
   }
   printf("Arquivo de imagem %s aberto.\n", image);
-  printf("Tamanho %d setores (%d bytes).\n", bl_size(), bl_size() * SECTORSIZE);
+  printf("Tamanho %d setores (%lld bytes).\n", bl_size(), (long long) bl_size() * SECTORSIZE);
   
   if (!fs_init()) {
     exit(0);
   }
 
+  if (script != NULL) {
+    ok = batch(script);
+    fs_shutdown();
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
 
-  format();
+  while (1) {
+    printf("> ");
+    if (fgets(linha, MAX_STR, stdin) == NULL || !command(linha)) {
+      fs_shutdown();
+      exit(EXIT_SUCCESS);
+    }
+  }
+}
 
-  
-  //explode();
-  createFile();
-  copyt("teste", "hello");
-  //nonSeq();
-  //createFile();
-  //readAndWrite();
+/* Executa uma linha de comando (alterada pela separação dos argumentos).
+ * Devolve 0 para o comando exit. */
+int command(char *linha) {
+  char *args[MAX_ARG + 1];
+  char *token;
+  int i;
+
+  i = 0;
+  token = strtok(linha, " \t\r\n");
+  while (token != NULL && i < MAX_ARG) {
+    args[i] = token;
+    i++;
+    token = strtok(NULL, " \t\r\n");
+  }
+  args[i] = NULL;
 
-  list();
+  if (args[0] == NULL) {
+    return 1;
+  }
 
+  if (!strcmp(args[0], "exit")) {
+    return 0;
+  } else if (!strcmp(args[0], "cache")) {
+    cache();
+  } else if (!strcmp(args[0], "stats")) {
+    if (i == 1) {
+      stats_print(stdout);
+    } else if (i == 2 && !strcmp(args[1], "reset")) {
+      stats_reset();
+    } else {
+      printf("Uso: stats [reset]\n");
+    }
+  } else if (!strcmp(args[0], "dedupstats")) {
+    dedupstats();
+  } else if (!strcmp(args[0], "format")) {
+    if (i == 1) {
+      format(0, 0);
+    } else if (i == 3) {
+      format(atoi(args[1]), atoi(args[2]));
+    } else {
+      printf("Uso: format [<bits da FAT (16 ou 32)> <cluster em KiB>]\n");
+    }
+  } else if (!strcmp(args[0], "list")) {
+    list();
+  } else if (!strcmp(args[0], "create")) {
+    if (i == 2) {
+      create(args[1]);
+    } else {
+      printf("Uso: create <file>\n");
+    }
+  } else if (!strcmp(args[0], "remove")) {
+    if (i == 2) {
+      fremove(args[1]);
+    } else {
+      printf("Uso: remove <file>\n");
+    }
+  } else if (!strcmp(args[0], "copy")) {
+    if (i == 3) {
+      copy(args[1], args[2]);
+    } else {
+      printf("Uso: copy <file1> <file2>\n");
+    }
+  } else if (!strcmp(args[0], "copyf")) {
+    if (i == 3) {
+      copyf(args[1], args[2], FS_W);
+    } else if (i == 4 && !strcmp(args[3], "-z")) {
+      copyf(args[1], args[2], FS_W | FS_Z);
+    } else if (i == 4 && !strcmp(args[3], "-d")) {
+      copyf(args[1], args[2], FS_W | FS_D);
+    } else {
+      printf("Uso: copyf <real_file> <file> [-z | -d]\n");
+    }
+  } else if (!strcmp(args[0], "copyt")) {
+    if (i == 3) {
+      copyt(args[1], args[2]);
+    } else {
+      printf("Uso: copyt <file> <real_file>\n");
+    }
+  } else {
+    printf("Comando inválido\n");
+  }
+  return 1;
+}
 
-  while (1) {
-    printf("> ");
-    linha[0] = '\0';
-    fgets(linha, MAX_STR, stdin);
+/* Modo não interativo: executa os comandos de script, uma linha por vez,
+ * e imprime o tempo de cada um e o total. Linhas vazias e as iniciadas
+ * por # são ignoradas. Devolve 0 se o script não puder ser lido. */
+int batch(char *script) {
+  FILE *f;
+  char linha[MAX_STR], texto[MAX_STR];
+  long long start, t, total;
+  int n, count, tam;
+  char c;
+
+  if ((f = fopen(script, "r")) == NULL) {
+    perror("Abrindo script");
+    return 0;
+  }
+
+  total = 0;
+  count = 0;
+  for (n = 1; fgets(linha, MAX_STR, f) != NULL; n++) {
     tam = strlen(linha);
     if (tam > 0 && linha[tam - 1] == '\n') {
-      linha[tam - 1] = '\0';
+      linha[--tam] = '\0';
     }
-
-    i = 0;
-    token = strtok(linha, " ");
-    while (token != NULL && i < MAX_ARG) {
-      args[i] = token;
-      i++;
-      token = strtok(NULL, " ");
+    if (tam > 0 && linha[tam - 1] == '\r') {
+      linha[--tam] = '\0';
     }
-    args[i] = NULL;
-    
-    if (args[0] == NULL) {
+    c = linha[strspn(linha, " \t")];
+    if (c == '\0' || c == '#') {
       continue;
     }
+    strcpy(texto, linha);
 
-    if (!strcmp(args[0], "exit")) {
-      exit(EXIT_SUCCESS);
-    } else if (!strcmp(args[0], "format")) {
-      format();
-    } else if (!strcmp(args[0], "list")) {
-      list();
-    } else if (!strcmp(args[0], "create")) {
-      if (i == 2) {
-	create(args[1]);
-      } else {
-	printf("Uso: create <file>\n");
-      }
-    } else if (!strcmp(args[0], "remove")) {
-      if (i == 2) {
-	fremove(args[1]);
-      } else {
-	printf("Uso: remove <file>\n");
-      }
-    } else if (!strcmp(args[0], "copy")) {
-      if (i == 3) {
-	copy(args[1], args[2]);
-      } else {
-	printf("Uso: copy <file1> <file2>\n");
-      }
-    } else if (!strcmp(args[0], "copyf")) {
-      if (i == 3) {
-	copyf(args[1], args[2]);
-      } else {
-	printf("Uso: copyf <real_file> <file>\n");
-      }
-    } else if (!strcmp(args[0], "copyt")) {
-      if (i == 3) {
-	copyt(args[1], args[2]);
-      } else {
-	printf("Uso: copyt <file> <real_file>\n");
-      }
-    } else {
-      printf("Comando inválido\n");
+    start = stats_clock();
+    if (!command(linha)) {
+      break;
     }
+    t = stats_clock() - start;
+    total += t;
+    count++;
+    printf("[%d] %.3f ms: %s\n", n, t / 1e6, texto);
   }
+  fclose(f);
+
+  printf("%d comandos em %.3f ms.\n", count, total / 1e6);
+  return 1;
 }
 
-void format() {
-  if (fs_format()) {
-    printf("Formatação concluída. %d bytes livres.\n", fs_free());
+/* Sem fat_bits, formata com a geometria atual. */
+void format(int fat_bits, int cluster_kib) {
+  int ok;
+
+  if (fat_bits == 0) {
+    ok = fs_format();
+  } else {
+    ok = fs_format_geometry(fat_bits, cluster_kib * 1024);
+  }
+  if (ok) {
+    printf("Formatação concluída. %lld bytes livres.\n", fs_free());
   }
 }
 
 void list() {
-  char buffer[4096];
-  if (fs_list(buffer, 4096)) {
+  char *buffer = malloc(LIST_BUFFER_SIZE);
+  if (buffer == NULL) {
+    printf("Memória insuficiente para a listagem\n");
+    return;
+  }
+  if (fs_list(buffer, LIST_BUFFER_SIZE)) {
     printf("%s", buffer);
-    printf("%d bytes livres.\n", fs_free());
+    printf("%lld bytes livres.\n", fs_free());
+  }
+  free(buffer);
+}
+
+void cache() {
+  bl_cache_stats stats;
+
+  bl_get_stats(&stats);
+  printf("Cache: %ld acertos, %ld faltas, %ld despejos, %ld escritas adiadas.\n",
+         stats.hits, stats.misses, stats.evictions, stats.writebacks);
+  printf("Imagem: %ld setores lidos, %ld setores escritos.\n", stats.reads, stats.writes);
+}
+
+void dedupstats() {
+  fs_dedup_stats stats;
+
+  if (fs_get_dedup_stats(&stats)) {
+    printf("Deduplicação: %lld clusters guardados, %lld referências, %lld bytes economizados.\n",
+           stats.clusters, stats.references, stats.saved);
   }
 }
 
@@ -212,86 +307,117 @@ void fremove(char *file) {
   fs_remove(file);
 }
 
+/* Buffer das cópias, alinhado ao setor: as transferências com o arquivo real
+ * e com a imagem andam em blocos grandes de clusters inteiros. */
+char *copy_buffer() {
+  static char *buffer = NULL;
+
+  if (buffer == NULL && posix_memalign((void **) &buffer, SECTORSIZE, COPY_BUFFER_SIZE) != 0) {
+    buffer = NULL;
+    printf("Memória insuficiente para a cópia\n");
+  }
+  return buffer;
+}
+
+/* A cópia dentro da imagem não copia dados: file2 compartilha os clusters
+ * de file1 até que um dos dois seja alterado, e uma escrita copia só os
+ * clusters compartilhados que ela reescreve (ver fs_clone); list mostra o
+ * que cada cópia ainda compartilha. */
 void copy(char *file1, char *file2) {
+  fs_clone(file1, file2);
+}
+
+/* O tamanho do arquivo real é conhecido de antemão (stat): a falta de espaço
+ * é detectada antes de abrir file2, que a abertura trunca (o espaço que o
+ * arquivo antigo devolve conta como livre), e o arquivo é lido com pread em blocos de
+ * COPY_BUFFER_SIZE, avisando ao sistema que a leitura é sequencial. Com
+ * FS_Z em mode, o arquivo é gravado comprimido, e com FS_D, deduplicado (e
+ * pode caber mesmo sem espaço para o tamanho original). */
+void copyf(char *file1, char *file2, int mode) {
   int fd1, fd2;
-  char buffer[COPY_BUFFER_SIZE];
-  int read;
+  char *buffer = copy_buffer();
+  struct stat st;
+  ssize_t read;
+  off_t pos;
 
-  if ((fd1 = fs_open(file1, FS_R)) == -1) {
+  if (buffer == NULL) {
     return;
   }
 
-  if ((fd2 = fs_open(file2, FS_W)) == -1) {
-    fs_close(fd1);
-    return;
-  }
-  while ((read = fs_read(buffer, COPY_BUFFER_SIZE, fd1)) > 0) {
-    if (fs_write(buffer, read, fd2) != read) {
-      fs_close(fd1);
-      fs_close(fd2);
-      return;
+  fd1 = open(file1, O_RDONLY);
+  if (fd1 == -1 || fstat(fd1, &st) == -1) {
+    perror("Abrindo arquivo real para cópia (leitura)");
+    if (fd1 != -1) {
+      close(fd1);
     }
+    return;
   }
+  posix_fadvise(fd1, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-  fs_close(fd1);
-  fs_close(fd2);
-}
-
-void copyf(char *file1, char *file2) {
-  int fd2;
-  char buffer[COPY_BUFFER_SIZE];
-  FILE *stream;
-  int read;
-
-  stream = fopen(file1, "r");
-  if (stream == NULL) {
-    perror("Abrindo arquivo real para cópia (leitura)");
+  if (S_ISREG(st.st_mode) && !(mode & (FS_Z | FS_D)) && st.st_size > fs_free() + fs_reclaimable(file2)) {
+    printf("Erro: Não há espaço o suficiente em disco\n");
+    close(fd1);
     return;
   }
 
-  if ((fd2 = fs_open(file2, FS_W)) == -1) {
-    fclose(stream);
+  if ((fd2 = fs_open(file2, mode)) == -1) {
+    close(fd1);
     return;
   }
 
-  while ((read = fread(buffer, sizeof(char), COPY_BUFFER_SIZE, stream)) > 0) {
+  pos = 0;
+  while ((read = pread(fd1, buffer, COPY_BUFFER_SIZE, pos)) > 0) {
     if (fs_write(buffer, read, fd2) != read) {
-      fclose(stream);
+      close(fd1);
       fs_close(fd2);
       return;
     }
+    pos += read;
+  }
+  if (read == -1) {
+    perror("Lendo arquivo real");
   }
 
-  fclose(stream);
+  close(fd1);
   fs_close(fd2);
 }
 
 void copyt(char *file1, char *file2) {
-  int fd1;
-  char buffer[COPY_BUFFER_SIZE];
-  FILE *stream;
+  int fd1, fd2;
+  char *buffer = copy_buffer();
   int read;
+  ssize_t n, done;
+  off_t pos;
+
+  if (buffer == NULL) {
+    return;
+  }
 
   if ((fd1 = fs_open(file1, FS_R)) == -1) {
     return;
   }
 
-  stream = fopen(file2, "w+");
-  if (stream == NULL) {
+  fd2 = open(file2, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd2 == -1) {
     perror("Abrindo arquivo real para cópia (escrita)");
     fs_close(fd1);
     return;
   }
 
+  pos = 0;
   while ((read = fs_read(buffer, COPY_BUFFER_SIZE, fd1)) > 0) {
-    if (fwrite(buffer, sizeof(char), read, stream) != read) {
-      perror("Escrevendo arquivo real");
-      fs_close(fd1);
-      fclose(stream);
-      return;
+    for (done = 0; done < read; done += n) {
+      n = pwrite(fd2, buffer + done, read - done, pos + done);
+      if (n <= 0) {
+        perror("Escrevendo arquivo real");
+        fs_close(fd1);
+        close(fd2);
+        return;
+      }
     }
+    pos += read;
   }
 
   fs_close(fd1);
-  fclose(stream);
+  close(fd2);
 }
@@ -0,0 +1,160 @@
+/*
+ * RSFS - Really Simple File System
+ *
+ * Copyright © 2026 LabSO-ProjetoFinal contributors
+ *
+ * This file is part of RSFS.
+ *
+ * RSFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "disk.h"
+#include "stats.h"
+
+#define STATS_ENV "RSFS_STATS"
+
+typedef struct {
+  long long calls;
+  long long bytes;
+  long long nsecs;
+  long long hist[STATS_BUCKETS];
+} op_stats;
+
+static char *op_names[ST_OPS] = {
+  "bl_read", "bl_write", "bl_readv", "bl_writev", "bl_map_read", "bl_sync",
+  "fs_init", "fs_format", "fs_free", "fs_reclaimable", "fs_list", "fs_create", "fs_remove",
+  "fs_clone", "fs_get_dedup_stats", "fs_open", "fs_close", "fs_read", "fs_write",
+  "fs_seek", "fs_pread", "fs_pwrite", "fs_sync", "fs_shutdown"
+};
+
+static char *counter_names[SC_COUNTERS] = {
+  "buscas no mapa de livres", "palavras do mapa examinadas", "clusters reservados",
+  "setores da FAT gravados", "setores do diretório gravados", "blocos do journal",
+  "setores do journal", "checkpoints", "gravações do superbloco"
+};
+
+long long stats_counters[SC_COUNTERS];
+static op_stats ops[ST_OPS];
+static bl_cache_stats cache_base;  /* Contadores da cache no último stats_reset */
+
+long long stats_clock() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Várias threads podem terminar medidas ao mesmo tempo: as somas são
+ * atômicas. */
+void stats_stop(stats_timer *t) {
+  long long ns = stats_clock() - t->start;
+  long long us = ns / 1000;
+  op_stats *s = &ops[t->op];
+  int b;
+
+  __atomic_fetch_add(&s->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->nsecs, ns, __ATOMIC_RELAXED);
+  if (t->bytes > 0) {
+    __atomic_fetch_add(&s->bytes, t->bytes, __ATOMIC_RELAXED);
+  }
+  b = us < 2 ? 0 : 63 - __builtin_clzll(us);
+  __atomic_fetch_add(&s->hist[b < STATS_BUCKETS ? b : STATS_BUCKETS - 1], 1, __ATOMIC_RELAXED);
+}
+
+void stats_reset() {
+  memset(ops, 0, sizeof(ops));
+  memset(stats_counters, 0, sizeof(stats_counters));
+  bl_get_stats(&cache_base);
+}
+
+/* Limite superior, em microssegundos, da faixa do histograma que contém a
+ * fração p das chamadas */
+static long long percentile(op_stats *s, double p) {
+  long long seen = 0;
+  int b;
+
+  for (b = 0; b < STATS_BUCKETS - 1; b++) {
+    seen += s->hist[b];
+    if (seen >= p * s->calls) {
+      break;
+    }
+  }
+  return 2LL << b;
+}
+
+/* Os percentis são os limites das faixas do histograma que os contêm. */
+void stats_print(FILE *out) {
+  bl_cache_stats c;
+  int i, b;
+
+  fprintf(out, "%-22s %10s %14s %12s %11s %9s %9s\n",
+          "operação", "chamadas", "bytes", "tempo(ms)", "médio(us)", "p50(us)", "p99(us)");
+  for (i = 0; i < ST_OPS; i++) {
+    op_stats *s = &ops[i];
+    if (s->calls == 0) {
+      continue;
+    }
+    fprintf(out, "%-20s %10lld %14lld %12.3f %10.1f %9lld %9lld\n", op_names[i], s->calls, s->bytes,
+            s->nsecs / 1e6, s->nsecs / 1e3 / s->calls, percentile(s, 0.5), percentile(s, 0.99));
+    fprintf(out, "  latências:");
+    for (b = 0; b < STATS_BUCKETS; b++) {
+      if (s->hist[b] > 0) {
+        fprintf(out, " <%lldus:%lld", 2LL << b, s->hist[b]);
+      }
+    }
+    fprintf(out, "\n");
+  }
+
+  for (i = 0; i < SC_COUNTERS; i++) {
+    fprintf(out, "%s: %lld\n", counter_names[i], stats_counters[i]);
+  }
+
+  bl_get_stats(&c);
+  fprintf(out, "cache: %ld acertos, %ld faltas, %ld despejos, %ld escritas adiadas\n",
+          c.hits - cache_base.hits, c.misses - cache_base.misses,
+          c.evictions - cache_base.evictions, c.writebacks - cache_base.writebacks);
+  fprintf(out, "imagem: %ld setores lidos, %ld setores gravados\n",
+          c.reads - cache_base.reads, c.writes - cache_base.writes);
+}
+
+/* Com RSFS_STATS definida, as estatísticas são impressas na saída do
+ * programa: na saída de erros (valor vazio ou "-") ou acrescentadas ao
+ * arquivo com esse nome. */
+static void stats_dump() {
+  char *dest = getenv(STATS_ENV);
+  FILE *out = stderr;
+
+  if (dest[0] != '\0' && strcmp(dest, "-") != 0 && (out = fopen(dest, "a")) == NULL) {
+    perror("Abrindo arquivo de estatísticas");
+    return;
+  }
+  stats_print(out);
+  if (out != stderr) {
+    fclose(out);
+  }
+}
+
+void stats_init() {
+  static int registered = 0;
+
+  if (!registered && getenv(STATS_ENV) != NULL) {
+    atexit(stats_dump);
+    registered = 1;
+  }
+}
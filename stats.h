@@ -0,0 +1,71 @@
+/*
+ * RSFS - Really Simple File System
+ *
+ * Copyright © 2026 LabSO-ProjetoFinal contributors
+ *
+ * This file is part of RSFS.
+ *
+ * RSFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+/* Operações medidas: chamadas, bytes e tempo, com um histograma das
+ * latências. Uma operação que chama outra (fs_write chama pwrite_file, que
+ * grava os setores com bl_writev) é contada nas duas. */
+enum {
+  ST_BL_READ, ST_BL_WRITE, ST_BL_READV, ST_BL_WRITEV, ST_BL_MAP_READ, ST_BL_SYNC,
+  ST_FS_INIT, ST_FS_FORMAT, ST_FS_FREE, ST_FS_RECLAIMABLE, ST_FS_LIST, ST_FS_CREATE, ST_FS_REMOVE,
+  ST_FS_CLONE, ST_FS_DEDUP_STATS, ST_FS_OPEN, ST_FS_CLOSE, ST_FS_READ, ST_FS_WRITE,
+  ST_FS_SEEK, ST_FS_PREAD, ST_FS_PWRITE, ST_FS_SYNC, ST_FS_SHUTDOWN,
+  ST_OPS
+};
+
+/* Contadores de eventos internos */
+enum {
+  SC_ALLOC_SCANS,      /* Buscas no mapa de clusters livres */
+  SC_ALLOC_WORDS,      /* Palavras do mapa examinadas nessas buscas */
+  SC_ALLOC_CLUSTERS,   /* Clusters reservados */
+  SC_FAT_SECTORS,      /* Setores da FAT gravados */
+  SC_DIR_SECTORS,      /* Setores do diretório gravados */
+  SC_JOURNAL_BLOCKS,   /* Blocos gravados no journal */
+  SC_JOURNAL_SECTORS,  /* e os setores que eles ocupam */
+  SC_CHECKPOINTS,
+  SC_SUPERBLOCKS,      /* Gravações do superbloco */
+  SC_COUNTERS
+};
+
+#define STATS_BUCKETS 32  /* Faixas de latência: até 2, 4, 8, ... microssegundos */
+
+/* Medida em andamento, terminada com stats_stop */
+typedef struct {
+  int op;
+  long long start;   /* Em nanossegundos (stats_clock) */
+  long long bytes;
+} stats_timer;
+
+extern long long stats_counters[SC_COUNTERS];
+
+/* Mede a função a partir deste ponto: a medida termina, com qualquer
+ * return, quando stats_t sai de escopo. STATS_BYTES informa os bytes
+ * transferidos e devolve n. */
+#define STATS_OP(op) stats_timer stats_t __attribute__((cleanup(stats_stop))) = {(op), stats_clock(), 0}
+#define STATS_BYTES(n) (stats_t.bytes = (n))
+#define STATS_COUNT(c, n) __atomic_fetch_add(&stats_counters[c], (n), __ATOMIC_RELAXED)
+
+void stats_init();
+long long stats_clock();
+void stats_stop(stats_timer *t);
+void stats_reset();
+void stats_print(FILE *out);